@@ -20,14 +20,18 @@
 
 /*! \file
  *
- * \brief AstMultiDialer: 9-line CLI dialer for Asterisk
+ * \brief AstMultiDialer: Multi-line CLI dialer for Asterisk
  *
  * \author Naveen Albert <asterisk@phreaknet.org>
  */
 
 /* == Configurable settings == */
 
-/* Will dial PJSIP/<PLAR CODE>@<PEER PREFIX><line #> */
+/* These are the defaults for every line, and can be changed in the [lines] sections of the config file */
+
+/* Will dial <TECH>/<PLAR CODE>@<PEER PREFIX><line #> */
+/* Channel technology of devices on remote server under testing */
+#define LINE_TECH "PJSIP"
 /* Prefix of device name on remote server under testing */
 #define PEER_PREFIX "autotest"
 /* PLAR code on the remote server under testing */
@@ -43,6 +47,16 @@
  */
 #define PLAR_DIALPLAN_CONTEXT "idle"
 #define PLAR_DIALPLAN_EXTEN "9999"
+/* Redirect to this context (and the line's extension) to play audio on a line.
+ * The file to play is in ${PLAYBACK_FILE}. Afterwards, it should go back to the context above.
+ *
+ * e.g.
+ * [play]
+ * exten => _X!,1,Playback(${PLAYBACK_FILE})
+ *     same => n,Goto(idle,${EXTEN},1)
+ */
+#define PLAYBACK_DIALPLAN_CONTEXT "play"
+#define PLAYBACK_MAX_FILE 96
 
 /*
  * This is a simple CLI based dialer that uses AMI (Asterisk Manager Interface)
@@ -65,345 +79,5448 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <poll.h>
 #include <termios.h>
 #include <pthread.h>
 #include <signal.h>
 #include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/timerfd.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include <cami/cami.h>
 #include <cami/cami_actions.h>
 
 static struct termios origterm, ttyterm;
-static char inputbuf[64] = "";
+static char inputbuf[256] = "";
+
+static char ami_username[64] = "";
+static char ami_password[64] = "";
+static int ami_debug_level = 0;
+
+struct ami_job;
+struct session;
+struct ami_conn;
+
+/*! \brief What's happening on a line, as seen from events */
+enum line_state {
+	LS_IDLE = 0,	/* No channel */
+	LS_DIALING,		/* Channel exists, but isn't ringing or up yet */
+	LS_RINGING,
+	LS_UP,
+	LS_HELD,
+	LS_CONF,		/* In a bridge with more than one other channel */
+	LS_MAX,			/* Must be last */
+};
 
 struct line {
+	/* State comes first, so that scanning the line table only touches the start of each line */
+	int actionid;				/* ActionID of in-progress async Originate, 0 if not known yet */
+	unsigned int offhook:1;
+	unsigned int originating:1;	/* Async Originate in progress */
+	unsigned int dtmf_active:1;	/* A DTMF digit is being sent or received */
+	unsigned int answering:1;	/* Redirect to answer the inbound call is in progress */
+	unsigned int answer_queued:1;	/* Waiting in the auto-answer queue */
+	unsigned int hanging_up:1;	/* Hangup from hanging up all lines hasn't finished yet */
+	unsigned int load_call:1;	/* Async originate is for the load generator */
+	unsigned char state;		/* enum line_state. Changed from events, and resynced after reconnecting, with lines_lock held. */
+	unsigned int version;		/* Incremented whenever state, DTMF or bridge changes, so the dashboard knows what to redraw */
+	unsigned int bridge;		/* Hash of the ID of the bridge the line is in, 0 if none */
+	char dtmf[5];				/* Last few DTMF digits seen on the line */
+	char dtmf_rx[8];			/* Last few DTMF digits received on the line, indexed by count, for waits */
+	unsigned int dtmf_received;	/* Number of DTMF digits received */
+	unsigned int dtmf_waited;	/* Number of received digits a wait has already looked at */
+	int next_index;				/* Next line in the same line index bucket */
+	int next_answer;			/* Next line in the auto-answer queue */
+	int64_t ring_start;			/* When the inbound call started ringing */
+	char inbound[128];			/* Inbound channel ringing the line, if any */
+	/* Action pipeline, protected by pipeline_lock */
+	int queued;					/* Number of actions queued or in progress */
+	int next_ready;				/* Next line in the ready list */
+	char busy;					/* An action for this line is in progress */
+	struct ami_job *jobs;		/* Queued actions, run in order */
+	struct ami_job *jobs_last;
+	struct session *session;	/* Server this line is on */
+	struct ami_conn *conn;		/* Connection to the server used for this line's actions */
+	struct pulse_train *pulse;	/* Pulse dialing in progress, protected by pulse_lock */
 	char devicename[64];
 	char dialstr[84];
-	char dialexten[64];
+	char dialcontext[48];
+	char dialexten[24];
 	char channel[128];
-	unsigned int offhook:1;
+	int64_t originate_queued;	/* When the async Originate was queued and sent, for the call log, 0 if not accepted yet */
+	int64_t originate_started;
+};
+
+
+#define DEFAULT_LINES 9
+#define DEFAULT_WINDOW 8
+#define MAX_LINES 1000000
+
+static struct line *lines = NULL; /* Leave index 0 unused for simplicitly, so we can use it 1-indexed. */
+static int num_lines = DEFAULT_LINES;
+static pthread_mutex_t lines_lock = PTHREAD_MUTEX_INITIALIZER; /* Protects line state modified from the event callback */
+
+/* Number of lines off hook, going off hook, and being answered, so metrics don't have to scan the lines */
+static int lines_offhook = 0;
+static int lines_originating = 0;
+static int lines_answering = 0;
+
+/*! \brief Set whether a line is off hook. Must be called with lines_lock held. */
+static void line_set_offhook(int n, int offhook)
+{
+	if (lines[n].offhook != (unsigned int) offhook) {
+		lines[n].offhook = (unsigned int) offhook;
+		__atomic_fetch_add(&lines_offhook, offhook ? 1 : -1, __ATOMIC_RELAXED);
+	}
+}
+
+/*! \brief Set whether a line has an async Originate in progress. Must be called with lines_lock held. */
+static void line_set_originating(int n, int originating)
+{
+	if (lines[n].originating != (unsigned int) originating) {
+		lines[n].originating = (unsigned int) originating;
+		__atomic_fetch_add(&lines_originating, originating ? 1 : -1, __ATOMIC_RELAXED);
+	}
+}
+
+/*! \brief Set whether a line is being answered. Must be called with lines_lock held. */
+static void line_set_answering(int n, int answering)
+{
+	if (lines[n].answering != (unsigned int) answering) {
+		lines[n].answering = (unsigned int) answering;
+		__atomic_fetch_add(&lines_answering, answering ? 1 : -1, __ATOMIC_RELAXED);
+	}
+}
+
+static int async_originate = 0;
+
+/* OriginateResponse events that arrived before the Originate response told us the ActionID */
+struct orphan_response {
+	struct orphan_response *next;
+	int actionid;
+	int success;
+	char channel[128];
+};
+
+/*
+ * Channel index, keyed by device name (channel name without the trailing -<sequence>).
+ * This is maintained from Newchannel/Hangup/Rename events, so that we can map a line's device
+ * to its current channel without having to dump every channel on the system.
+ */
+
+#define CHAN_INDEX_BUCKETS 1024
+
+struct chan_entry {
+	struct chan_entry *next;
+	char device[64];
+	char channel[128];
+};
+
+/*!
+ * \brief One AMI connection to a server
+ * \note Each connection has its own pool of workers, so a slow action only holds up the lines sharing its connection.
+ *       Only the first connection to a server receives events; the others are only used for actions.
+ */
+struct ami_conn {
+	struct session *session;
+	struct ami_session *ami;
+	int index;					/* Index in the server's connections */
+	int down;					/* Disconnected, waiting to reconnect. Protected by pipeline_lock */
+	int64_t down_since;
+	/* Action pipeline, protected by pipeline_lock */
+	pthread_cond_t pipeline_cond;	/* Signaled when a line becomes ready */
+	int ready_head;				/* List of lines with actions that can be started, linked by next_ready */
+	int ready_tail;
+	int inflight;				/* Actions being executed on the current session */
+	int nthreads;
+	pthread_t *threads;
+};
+
+/*!
+ * \brief An Asterisk server, and the lines on it
+ * \note Each server has its own channel index and connections, so a slow server doesn't hold up actions to others.
+ */
+struct session {
+	char name[32];
+	char host[92];
+	int port;
+	struct ami_conn *conns;		/* Pool of connections. Lines are spread across them. */
+	int nconns;
+	int first_line;				/* Lines on this server */
+	int last_line;
+	struct chan_entry *chan_index[CHAN_INDEX_BUCKETS];
+	pthread_mutex_t chan_index_lock;
+	struct orphan_response *orphans;	/* Protected by lines_lock */
+};
+
+#define MAX_SESSIONS 32
+#define MAX_CONNECTIONS 64
+
+static struct session sessions[MAX_SESSIONS];
+static int num_sessions = 0;
+static int connections_per_session = 1;
+static int event_filter = 1;	/* Ask servers to only send us events we care about */
+
+static unsigned int string_hash(const char *s, size_t len)
+{
+	unsigned int hash = 5381;
+
+	while (len--) {
+		hash = ((hash << 5) + hash) + (unsigned char) *s++;
+	}
+	return hash;
+}
+
+static unsigned int chan_index_hash(const char *s, size_t len)
+{
+	return string_hash(s, len) % CHAN_INDEX_BUCKETS;
+}
+
+/*! \brief Length of the device portion of a channel name, e.g. PJSIP/autotest1 for PJSIP/autotest1-00000001 */
+static size_t channel_device_len(const char *channel)
+{
+	const char *dash = strrchr(channel, '-');
+	return dash ? (size_t) (dash - channel) : strlen(channel);
+}
+
+static void chan_index_add(struct session *session, const char *channel)
+{
+	struct chan_entry *entry;
+	size_t devlen = channel_device_len(channel);
+	unsigned int bucket;
+
+	if (devlen >= sizeof(entry->device)) {
+		return; /* Can't be one of ours */
+	}
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry) {
+		return;
+	}
+	memcpy(entry->device, channel, devlen);
+	strncpy(entry->channel, channel, sizeof(entry->channel) - 1);
+
+	bucket = chan_index_hash(channel, devlen);
+	pthread_mutex_lock(&session->chan_index_lock);
+	/* Insert at the head, so the newest channel for a device is found first */
+	entry->next = session->chan_index[bucket];
+	session->chan_index[bucket] = entry;
+	pthread_mutex_unlock(&session->chan_index_lock);
+}
+
+static void chan_index_remove(struct session *session, const char *channel)
+{
+	struct chan_entry *entry, **prev;
+	unsigned int bucket = chan_index_hash(channel, channel_device_len(channel));
+
+	pthread_mutex_lock(&session->chan_index_lock);
+	for (prev = &session->chan_index[bucket]; (entry = *prev); prev = &entry->next) {
+		if (!strcmp(entry->channel, channel)) {
+			*prev = entry->next;
+			free(entry);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&session->chan_index_lock);
+}
+
+/*! \brief Find the newest channel for a device. Returns 0 if found, -1 otherwise */
+static int chan_index_find(struct session *session, const char *device, char *buf, size_t len)
+{
+	struct chan_entry *entry;
+	int res = -1;
+	unsigned int bucket = chan_index_hash(device, strlen(device));
+
+	pthread_mutex_lock(&session->chan_index_lock);
+	for (entry = session->chan_index[bucket]; entry; entry = entry->next) {
+		if (!strcmp(entry->device, device)) {
+			snprintf(buf, len, "%s", entry->channel);
+			res = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&session->chan_index_lock);
+	return res;
+}
+
+static void chan_index_destroy(struct session *session)
+{
+	int i;
+
+	pthread_mutex_lock(&session->chan_index_lock);
+	for (i = 0; i < CHAN_INDEX_BUCKETS; i++) {
+		struct chan_entry *entry;
+		while ((entry = session->chan_index[i])) {
+			session->chan_index[i] = entry->next;
+			free(entry);
+		}
+	}
+	pthread_mutex_unlock(&session->chan_index_lock);
+}
+
+static void load_originate_complete(int n, int success);
+static void calllog_originate_response(int n, int success, const char *channel);
+
+/*! \brief Finish an async originate on a line. Must be called with lines_lock held. */
+static void originate_complete(int n, int success, const char *channel)
+{
+	line_set_originating(n, 0);
+	lines[n].actionid = 0;
+	if (lines[n].originate_started) {
+		/* Asterisk accepted the Originate; now we know how it actually went */
+		calllog_originate_response(n, success, success ? channel : lines[n].dialstr);
+		lines[n].originate_started = 0;
+	}
+	if (success) {
+		/* Prefer what the channel index knows, since that has the real channel name */
+		if (chan_index_find(lines[n].session, lines[n].devicename, lines[n].channel, sizeof(lines[n].channel))) {
+			snprintf(lines[n].channel, sizeof(lines[n].channel), "%s", channel);
+		}
+		line_set_offhook(n, 1);
+	}
+	if (lines[n].load_call) {
+		/* Only once the channel is set, since the load generator may hang up right away */
+		lines[n].load_call = 0;
+		load_originate_complete(n, success);
+	} else if (success) {
+		fprintf(stderr, "Line %d is off hook (%s)\n", n, lines[n].channel);
+	} else {
+		fprintf(stderr, "Failed to go off hook on line %d\n", n);
+	}
+}
+
+/*!
+ * \brief Whether an OriginateResponse is for a line
+ * \note ActionIDs are only unique per connection, so if a server has several connections,
+ *       also check the channel (the new channel on success, or the dial string on failure).
+ */
+static int originate_response_matches(int n, int actionid, const char *channel)
+{
+	size_t len;
+
+	if (lines[n].actionid != actionid) {
+		return 0;
+	}
+	if (lines[n].session->nconns == 1 || !*channel) {
+		return 1;
+	}
+	len = strlen(lines[n].devicename);
+	return !strcmp(channel, lines[n].dialstr) || (!strncmp(channel, lines[n].devicename, len) && (channel[len] == '-' || !channel[len]));
+}
+
+/*! \brief Record the ActionID for an async originate, completing it if the OriginateResponse already arrived */
+static void originate_queued(int n, int actionid)
+{
+	struct orphan_response *orphan, **prev;
+	struct session *session = lines[n].session;
+
+	pthread_mutex_lock(&lines_lock);
+	lines[n].actionid = actionid;
+	for (prev = &session->orphans; (orphan = *prev); prev = &orphan->next) {
+		if (originate_response_matches(n, orphan->actionid, orphan->channel)) {
+			*prev = orphan->next;
+			originate_complete(n, orphan->success, orphan->channel);
+			free(orphan);
+			break;
+		}
+	}
+	for (n = session->first_line; n <= session->last_line; n++) {
+		if (lines[n].originating && !lines[n].actionid) {
+			break;
+		}
+	}
+	if (n > session->last_line) {
+		/* Nobody else is waiting, so anything left over belongs to somebody else's originates */
+		while ((orphan = session->orphans)) {
+			session->orphans = orphan->next;
+			free(orphan);
+		}
+	}
+	pthread_mutex_unlock(&lines_lock);
+}
+
+static void handle_originate_response(struct session *session, struct ami_event *event)
+{
+	int i, actionid, success, waiting = 0;
+	const char *channel, *response, *tmp;
+
+	tmp = ami_keyvalue(event, "ActionID");
+	actionid = tmp ? atoi(tmp) : 0;
+	if (!actionid) {
+		return;
+	}
+	response = ami_keyvalue(event, "Response");
+	success = response && !strcasecmp(response, "Success");
+	channel = ami_keyvalue(event, "Channel");
+	if (!channel) {
+		channel = "";
+	}
+
+	pthread_mutex_lock(&lines_lock);
+	for (i = session->first_line; i <= session->last_line; i++) {
+		if (!lines[i].originating) {
+			continue;
+		}
+		if (originate_response_matches(i, actionid, channel)) {
+			originate_complete(i, success, channel);
+			break;
+		} else if (!lines[i].actionid) {
+			waiting = 1;
+		}
+	}
+	if (i > session->last_line && waiting) {
+		/* Could be for an originate that hasn't gotten its response back yet. Hang onto it. */
+		struct orphan_response *orphan = calloc(1, sizeof(*orphan));
+		if (orphan) {
+			orphan->actionid = actionid;
+			orphan->success = success;
+			strncpy(orphan->channel, channel, sizeof(orphan->channel) - 1);
+			orphan->next = session->orphans;
+			session->orphans = orphan;
+		}
+	}
+	pthread_mutex_unlock(&lines_lock);
+}
+
+static void orphans_destroy(struct session *session)
+{
+	struct orphan_response *orphan;
+
+	pthread_mutex_lock(&lines_lock);
+	while ((orphan = session->orphans)) {
+		session->orphans = orphan->next;
+		free(orphan);
+	}
+	pthread_mutex_unlock(&lines_lock);
+}
+
+static struct ami_conn *conn_from_ami(struct ami_session *ami)
+{
+	int i, j;
+
+	for (i = 0; i < num_sessions; i++) {
+		for (j = 0; j < sessions[i].nconns; j++) {
+			if (sessions[i].conns[j].ami == ami) {
+				return &sessions[i].conns[j];
+			}
+		}
+	}
+	return NULL;
+}
+
+static int64_t monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Line state
+ *
+ * The state of each line is tracked from channel events, so it can be shown on the dashboard.
+ * Events are mapped to lines using the line index, a hash table of device names.
+ */
+
+/* Event traffic received from all servers, for measuring how well events are filtered */
+static uint64_t events_received = 0;
+static uint64_t event_bytes_received = 0;
+static int64_t events_since = 0;
+
+static int *line_index = NULL;	/* Buckets, each the first line in the bucket, or 0 */
+static unsigned int line_index_mask = 0;
+static int state_counts[LS_MAX];	/* Number of lines in each state */
+static int state_changed = 0;		/* Set whenever a line's state changes, cleared by the dashboard */
+
+static pthread_cond_t line_wait_cond;	/* Signaled when a line changes, if anybody is waiting. Uses CLOCK_MONOTONIC. */
+static int line_waiters = 0;
+
+/* Used by the w command, so they must be distinct in their first 2 letters. The dashboard only shows the first 4. */
+static const char *state_names[LS_MAX] = {
+	[LS_IDLE] = "idle",
+	[LS_DIALING] = "dialing",
+	[LS_RINGING] = "ringing",
+	[LS_UP] = "up",
+	[LS_HELD] = "held",
+	[LS_CONF] = "conf",
+};
+
+/* Lines with an inbound call waiting to be answered automatically, in the order they started ringing. Protected by lines_lock. */
+static int auto_answer_ms = -1;		/* How long to let inbound calls ring before answering them, -1 to not answer automatically */
+static int answer_head = 0;
+static int answer_tail = 0;
+static pthread_cond_t answer_cond;	/* Signaled when a line is added to the queue. Uses CLOCK_MONOTONIC. */
+static int answer_shutdown = 0;		/* Set when auto-answer stops, after which answer_cond is destroyed */
+
+/*! \brief Find the line a channel belongs to. Returns the line number, or 0 if it isn't one of ours. */
+static int line_from_channel(struct session *session, const char *channel)
+{
+	size_t len;
+	int n;
+
+	if (!line_index || !channel) {
+		return 0;
+	}
+	len = channel_device_len(channel);
+	for (n = line_index[string_hash(channel, len) & line_index_mask]; n; n = lines[n].next_index) {
+		if (lines[n].session == session && !strncmp(lines[n].devicename, channel, len) && !lines[n].devicename[len]) {
+			return n;
+		}
+	}
+	return 0;
+}
+
+static void line_wait_init(void)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&line_wait_cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+/*! \brief Note that something about a line changed. Must be called with lines_lock held. */
+static void line_changed(int n)
+{
+	lines[n].version++;
+	__atomic_store_n(&state_changed, 1, __ATOMIC_RELEASE);
+	if (line_waiters) {
+		pthread_cond_broadcast(&line_wait_cond);
+	}
+}
+
+/*! \brief Change the state of a line, keeping the per-state counts in step. Must be called with lines_lock held. */
+static void line_set_state(int n, enum line_state state)
+{
+	if (lines[n].state == state) {
+		return;
+	}
+	__atomic_fetch_sub(&state_counts[lines[n].state], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&state_counts[state], 1, __ATOMIC_RELAXED);
+	lines[n].state = state;
+	line_changed(n);
+}
+
+/*! \brief Update the state of lines in a bridge, when the number of channels in it changes */
+static void bridge_changed(struct session *session, unsigned int bridge, int count)
+{
+	int n;
+
+	for (n = session->first_line; n <= session->last_line; n++) {
+		if (lines[n].bridge != bridge) {
+			continue;
+		}
+		if (count > 2 && lines[n].state == LS_UP) {
+			line_set_state(n, LS_CONF);
+		} else if (count <= 2 && lines[n].state == LS_CONF) {
+			line_set_state(n, LS_UP);
+		}
+	}
+}
+
+/*! \brief An inbound call started ringing a line */
+static void line_incoming(int n, const char *channel)
+{
+	snprintf(lines[n].inbound, sizeof(lines[n].inbound), "%s", channel);
+	lines[n].ring_start = monotonic_ns();
+	if (lines[n].offhook) {
+		fprintf(stderr, "Call waiting on line %d (%s)\n", n, channel);
+		return;
+	}
+	line_set_state(n, LS_RINGING);
+	fprintf(stderr, "Line %d is ringing (%s)\n", n, channel);
+	if (auto_answer_ms >= 0 && !lines[n].answer_queued) {
+		lines[n].answer_queued = 1;
+		lines[n].next_answer = 0;
+		if (answer_tail) {
+			lines[answer_tail].next_answer = n;
+		} else {
+			answer_head = n;
+		}
+		answer_tail = n;
+		if (!answer_shutdown) {
+			/* Events can still come in while we're exiting */
+			pthread_cond_signal(&answer_cond);
+		}
+	}
+}
+
+/*! \brief Update line state from a channel event. Must be called with lines_lock held. */
+static void line_state_event(struct session *session, const char *name, struct ami_event *event, const char *channel)
+{
+	const char *tmp;
+	int n = line_from_channel(session, channel);
+
+	if (!strcmp(name, "DialBegin")) {
+		/* If the callee is one of our lines, it's ringing */
+		int callee = line_from_channel(session, ami_keyvalue(event, "DestChannel"));
+		if (callee) {
+			line_set_state(callee, LS_RINGING);
+		}
+		if (n) {
+			line_set_state(n, LS_DIALING);
+		}
+		return;
+	}
+	if (!n) {
+		if (!strcmp(name, "BridgeEnter") || !strcmp(name, "BridgeLeave")) {
+			/* Another channel joining or leaving a line's bridge can make it a conference, or stop it being one */
+			const char *id = ami_keyvalue(event, "BridgeUniqueid");
+			tmp = ami_keyvalue(event, "BridgeNumChannels");
+			if (id && *id && tmp) {
+				bridge_changed(session, string_hash(id, strlen(id)) | 1, atoi(tmp));
+			}
+		}
+		return;
+	}
+
+	if (!strcmp(name, "Newchannel") || !strcmp(name, "Newstate")) {
+		tmp = ami_keyvalue(event, "ChannelState");
+		switch (tmp ? atoi(tmp) : 0) {
+			case 4: /* Ring. Channels we originate start out Down, so a new channel in this state is an inbound call. */
+				if (!strcmp(name, "Newchannel")) {
+					line_incoming(n, channel);
+					break;
+				}
+				line_set_state(n, LS_DIALING);
+				break;
+			case 5: /* Ringing */
+				line_set_state(n, LS_RINGING);
+				break;
+			case 6: /* Up */
+				if (lines[n].state != LS_HELD && lines[n].state != LS_CONF) {
+					line_set_state(n, LS_UP);
+				}
+				break;
+			default: /* Down, Reserved, Off hook, Dialing, Ring, etc. */
+				line_set_state(n, LS_DIALING);
+				break;
+		}
+	} else if (!strcmp(name, "DialEnd")) {
+		tmp = ami_keyvalue(event, "DialStatus");
+		if (tmp && !strcmp(tmp, "ANSWER")) {
+			line_set_state(n, LS_UP);
+		}
+	} else if (!strcmp(name, "Hangup")) {
+		if (!strcmp(channel, lines[n].inbound)) {
+			lines[n].inbound[0] = '\0';
+			if (!lines[n].answering) {
+				fprintf(stderr, "Line %d stopped ringing\n", n);
+			}
+			if (lines[n].offhook && strcmp(channel, lines[n].channel)) {
+				return; /* A waiting call went away, but the line is still on its original call */
+			}
+		}
+		lines[n].bridge = 0;
+		lines[n].dtmf_active = 0;
+		line_set_state(n, LS_IDLE);
+	} else if (!strcmp(name, "Hold")) {
+		line_set_state(n, LS_HELD);
+	} else if (!strcmp(name, "Unhold")) {
+		line_set_state(n, LS_UP);
+	} else if (!strcmp(name, "BridgeEnter") || !strcmp(name, "BridgeLeave")) {
+		const char *id = ami_keyvalue(event, "BridgeUniqueid");
+		unsigned int bridge = id ? string_hash(id, strlen(id)) | 1 : 0;
+		tmp = ami_keyvalue(event, "BridgeNumChannels");
+		if (!strcmp(name, "BridgeEnter")) {
+			lines[n].bridge = bridge;
+			if (lines[n].state != LS_HELD) {
+				line_set_state(n, LS_UP);
+			}
+		} else {
+			lines[n].bridge = 0;
+			if (lines[n].state == LS_CONF) {
+				line_set_state(n, LS_UP);
+			}
+		}
+		if (bridge && tmp) {
+			bridge_changed(session, bridge, atoi(tmp));
+		}
+		line_changed(n);
+	} else if (!strcmp(name, "DTMFBegin")) {
+		lines[n].dtmf_active = 1;
+		line_changed(n);
+	} else if (!strcmp(name, "DTMFEnd")) {
+		tmp = ami_keyvalue(event, "Digit");
+		if (tmp && *tmp) {
+			/* Keep the last few digits */
+			size_t len = strlen(lines[n].dtmf);
+			if (len == sizeof(lines[n].dtmf) - 1) {
+				memmove(lines[n].dtmf, lines[n].dtmf + 1, len);
+				len--;
+			}
+			lines[n].dtmf[len] = *tmp;
+			lines[n].dtmf[len + 1] = '\0';
+			if (ami_keyvalue(event, "Direction") && !strcmp(ami_keyvalue(event, "Direction"), "Received")) {
+				lines[n].dtmf_rx[lines[n].dtmf_received++ % sizeof(lines[n].dtmf_rx)] = *tmp;
+			}
+		}
+		lines[n].dtmf_active = 0;
+		line_changed(n);
+	}
+}
+
+/*! \brief Callback function executing asynchronously when new events are available */
+static void ami_callback(struct ami_session *ami, struct ami_event *event)
+{
+	const char *name, *channel;
+	struct ami_conn *conn = conn_from_ami(ami);
+	struct session *session = conn ? conn->session : NULL;
+	uint64_t bytes = 2; /* Blank line at the end */
+	int i;
+
+	/* Roughly how much this event took on the wire, as "Key: Value\r\n" lines */
+	for (i = 0; i < event->size; i++) {
+		bytes += strlen(event->fields[i].key) + strlen(event->fields[i].value) + 4;
+	}
+	__atomic_fetch_add(&events_received, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&event_bytes_received, bytes, __ATOMIC_RELAXED);
+
+	name = ami_keyvalue(event, "Event");
+	channel = ami_keyvalue(event, "Channel");
+	if (!conn || conn->index) {
+		/* Not logged in yet, or not the connection we handle events on, so ignore it */
+	} else if (name && !strcmp(name, "OriginateResponse")) {
+		handle_originate_response(session, event);
+	} else if (name && channel && *channel) {
+		if (!strcmp(name, "Newchannel")) {
+			chan_index_add(session, channel);
+		} else if (!strcmp(name, "Hangup")) {
+			chan_index_remove(session, channel);
+		} else if (!strcmp(name, "Rename")) {
+			const char *newname = ami_keyvalue(event, "Newname");
+			chan_index_remove(session, channel);
+			if (newname && *newname) {
+				chan_index_add(session, newname);
+			}
+		}
+		pthread_mutex_lock(&lines_lock);
+		line_state_event(session, name, event, channel);
+		pthread_mutex_unlock(&lines_lock);
+	}
+
+	ami_event_free(event); /* We're done with it. */
+}
+
+/*
+ * Latency statistics
+ *
+ * Latency of each type of AMI action is recorded in a log-linear histogram (like HdrHistogram):
+ * values (in microseconds) are bucketed by power of 2, and each power of 2 is split into
+ * 16 linear sub-buckets, so percentiles are accurate to within about 6%.
+ * Everything is updated atomically, so workers can record without taking any locks.
+ */
+
+#define HIST_SUB_BUCKETS 16
+#define HIST_BUCKETS (2 * HIST_SUB_BUCKETS + 40 * HIST_SUB_BUCKETS)
+
+enum stat_type {
+	STAT_ORIGINATE = 0,
+	STAT_HANGUP,
+	STAT_SENDFLASH,
+	STAT_PLAYDTMF,
+	STAT_SHOWCHANNELS,
+	STAT_REDIRECT,
+	STAT_LOGIN,
+	STAT_OTHER,
+	STAT_RING_ANSWER,	/* Not an action: how long inbound calls rang before they were answered */
+	STAT_MAX, /* Must be last */
+};
+
+static const char *stat_names[STAT_MAX] = {
+	[STAT_ORIGINATE] = "Originate",
+	[STAT_HANGUP] = "Hangup",
+	[STAT_SENDFLASH] = "SendFlash",
+	[STAT_PLAYDTMF] = "PlayDTMF",
+	[STAT_SHOWCHANNELS] = "ShowChannels",
+	[STAT_REDIRECT] = "Redirect",
+	[STAT_LOGIN] = "Login",
+	[STAT_OTHER] = "Other",
+	[STAT_RING_ANSWER] = "Answered",
+};
+
+struct latency_hist {
+	uint64_t count;
+	uint64_t errors;
+	uint64_t sum;	/* Microseconds */
+	uint64_t max;	/* Microseconds */
+	uint64_t buckets[HIST_BUCKETS];
 };
 
-struct ami_session *global_ami = NULL;
+static struct latency_hist stats[STAT_MAX];
+
+static enum stat_type stat_type(const char *action)
+{
+	int i;
+
+	for (i = 0; i < STAT_OTHER; i++) {
+		if (!strcasecmp(action, stat_names[i])) {
+			return i;
+		}
+	}
+	return STAT_OTHER;
+}
+
+static int hist_index(uint64_t us)
+{
+	int msb, shift;
+
+	if (us < 2 * HIST_SUB_BUCKETS) {
+		return (int) us;
+	}
+	msb = 63 - __builtin_clzll(us);
+	shift = msb - 4; /* So that us >> shift is in [16, 32) */
+	if (shift > 40) {
+		return HIST_BUCKETS - 1;
+	}
+	return 2 * HIST_SUB_BUCKETS + (shift - 1) * HIST_SUB_BUCKETS + (int) ((us >> shift) - HIST_SUB_BUCKETS);
+}
+
+/*! \brief Highest value that maps to a bucket */
+static uint64_t hist_value(int index)
+{
+	int shift;
+	uint64_t sub;
+
+	if (index < 2 * HIST_SUB_BUCKETS) {
+		return (uint64_t) index;
+	}
+	shift = (index - 2 * HIST_SUB_BUCKETS) / HIST_SUB_BUCKETS + 1;
+	sub = (uint64_t) ((index - 2 * HIST_SUB_BUCKETS) % HIST_SUB_BUCKETS + HIST_SUB_BUCKETS);
+	return ((sub + 1) << shift) - 1;
+}
+
+/*! \brief Record the latency of an action */
+static void stats_record(enum stat_type type, int64_t ns, int success)
+{
+	struct latency_hist *hist = &stats[type];
+	uint64_t us = ns > 0 ? (uint64_t) ns / 1000 : 0;
+	uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+
+	__atomic_fetch_add(&hist->buckets[hist_index(us)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->sum, us, __ATOMIC_RELAXED);
+	if (!success) {
+		__atomic_fetch_add(&hist->errors, 1, __ATOMIC_RELAXED);
+	}
+	while (us > max && !__atomic_compare_exchange_n(&hist->max, &max, us, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	__atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED); /* Last, so readers don't see more buckets than the count */
+}
+
+/*! \brief Count a failure that has no meaningful latency, e.g. an inbound call that couldn't be answered */
+static void stats_record_failure(enum stat_type type)
+{
+	__atomic_fetch_add(&stats[type].errors, 1, __ATOMIC_RELAXED);
+}
+
+/*! \brief Value (in microseconds) at a given percentile */
+static uint64_t hist_percentile(struct latency_hist *hist, uint64_t count, double percentile)
+{
+	uint64_t seen = 0, target = (uint64_t) ceil(percentile / 100.0 * (double) count);
+	uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+	int i;
+
+	if (!target) {
+		target = 1;
+	}
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+		if (seen >= target) {
+			uint64_t value = hist_value(i);
+			return value < max ? value : max;
+		}
+	}
+	return max;
+}
+
+#define STATS_HEADER_FMT "%-13s %9s %7s %10s %10s %10s %10s %10s\n"
+
+static void stats_dump_hist(enum stat_type type)
+{
+	struct latency_hist *hist = &stats[type];
+	uint64_t count = __atomic_load_n(&hist->count, __ATOMIC_ACQUIRE);
+	uint64_t errors = __atomic_load_n(&hist->errors, __ATOMIC_RELAXED);
+
+	if (!count && !errors) {
+		return;
+	}
+	fprintf(stderr, "%-13s %9lu %7lu %10.3f %10.3f %10.3f %10.3f %10.3f\n", stat_names[type],
+		(unsigned long) count, (unsigned long) errors,
+		count ? (double) __atomic_load_n(&hist->sum, __ATOMIC_RELAXED) / (double) count / 1000.0 : 0.0,
+		(double) hist_percentile(hist, count, 50) / 1000.0,
+		(double) hist_percentile(hist, count, 99) / 1000.0,
+		(double) hist_percentile(hist, count, 99.9) / 1000.0,
+		(double) __atomic_load_n(&hist->max, __ATOMIC_RELAXED) / 1000.0);
+}
+
+static void stats_dump(void)
+{
+	int i;
+
+	fprintf(stderr, "AMI action latency (ms):\n");
+	fprintf(stderr, STATS_HEADER_FMT, "Action", "Count", "Errors", "Avg", "p50", "p99", "p99.9", "Max");
+	for (i = 0; i <= STAT_OTHER; i++) {
+		stats_dump_hist(i);
+	}
+	if (__atomic_load_n(&stats[STAT_RING_ANSWER].count, __ATOMIC_ACQUIRE) || __atomic_load_n(&stats[STAT_RING_ANSWER].errors, __ATOMIC_RELAXED)) {
+		/* Calls that couldn't be answered are only counted as errors, since how long they rang says nothing */
+		fprintf(stderr, "Ring to answer time of inbound calls (ms):\n");
+		fprintf(stderr, STATS_HEADER_FMT, "", "Count", "Errors", "Avg", "p50", "p99", "p99.9", "Max");
+		stats_dump_hist(STAT_RING_ANSWER);
+	}
+	if (events_since) {
+		double secs = (double) (monotonic_ns() - events_since) / 1000000000.0;
+		uint64_t count = __atomic_load_n(&events_received, __ATOMIC_RELAXED);
+		double kb = (double) __atomic_load_n(&event_bytes_received, __ATOMIC_RELAXED) / 1024.0;
+		fprintf(stderr, "Events received: %lu (%.1f/s), %.1f KB (%.1f KB/s) in %.1f s\n",
+			(unsigned long) count, secs > 0 ? (double) count / secs : 0.0, kb, secs > 0 ? kb / secs : 0.0, secs);
+	}
+}
+
+/*! \brief Whether any actions have been recorded */
+static int stats_any(void)
+{
+	int i;
+
+	for (i = 0; i < STAT_MAX; i++) {
+		if (__atomic_load_n(&stats[i].count, __ATOMIC_RELAXED) || __atomic_load_n(&stats[i].errors, __ATOMIC_RELAXED)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Call log
+ *
+ * Every action done on a line is logged as a fixed-size binary record, for analysis after a run.
+ * Records are put in a lock-free ring buffer (a bounded MPSC queue: each slot has a sequence number
+ * saying whether it's free or full), which a background thread flushes to the log file. If the ring fills up
+ * (e.g. the disk can't keep up), records are dropped and counted, rather than holding up any actions.
+ *
+ * The file is a series of CALLLOG_RECORD_SIZE byte records. Each run starts with a header record,
+ * with the clock times needed to convert the monotonic timestamps in the records to wall clock time.
+ * Use -x (CSV) or -X (JSON) to convert a log into something more readable.
+ */
+
+#define CALLLOG_RECORD_SIZE 128
+#define CALLLOG_VERSION 1
+#define CALLLOG_MAGIC "AMDCALLS"
+#define CALLLOG_SLOTS 16384			/* Must be a power of 2 */
+#define CALLLOG_FLUSH_INTERVAL_US 50000
+
+enum calllog_kind {
+	CALLLOG_HEADER = 1,
+	CALLLOG_ACTION = 2,
+};
+
+enum calllog_result {
+	CALLLOG_SUCCESS = 0,
+	CALLLOG_FAILED,			/* Error response */
+	CALLLOG_NO_RESPONSE,	/* e.g. the connection was lost */
+};
+
+struct calllog_header {
+	uint8_t kind;
+	uint8_t version;
+	uint16_t record_size;
+	uint32_t reserved;
+	char magic[8];
+	int64_t monotonic;		/* Monotonic and wall clock times at the same instant, in ns */
+	int64_t realtime;
+	char pad[CALLLOG_RECORD_SIZE - 32];
+};
+
+struct calllog_record {
+	uint8_t kind;
+	uint8_t result;			/* enum calllog_result */
+	uint16_t server;		/* Index of the server, in the order given with -l */
+	uint32_t line;
+	int64_t queued;			/* Monotonic times, in ns */
+	int64_t start;
+	int64_t end;
+	char action[24];
+	char arg[8];			/* e.g. the digit, for PlayDTMF */
+	char channel[64];		/* Channel (or dial string, for Originate) */
+};
+
+_Static_assert(sizeof(struct calllog_header) == CALLLOG_RECORD_SIZE, "Call log header must be one record");
+_Static_assert(sizeof(struct calllog_record) == CALLLOG_RECORD_SIZE, "Call log record size changed");
+
+struct calllog_slot {
+	uint64_t seq;	/* Position this slot can next be written at, or that plus 1 if it's full */
+	struct calllog_record rec;
+};
+
+static char calllog_file[256] = "";
+static int calllog_fd = -1;
+static struct calllog_slot *calllog_slots = NULL;
+static uint64_t calllog_tail = 0;	/* Next position to write. Producers claim positions by CAS. */
+static uint64_t calllog_head = 0;	/* Next position to flush. Only used by the flusher. */
+static uint64_t calllog_drops = 0;
+static int calllog_shutdown = 0;
+static pthread_t calllog_thread;
+
+/*! \brief Add a record to the call log. Never blocks: if the ring is full, the record is dropped. */
+static void calllog_add(const struct calllog_record *rec)
+{
+	struct calllog_slot *slot;
+	uint64_t pos = __atomic_load_n(&calllog_tail, __ATOMIC_RELAXED);
+
+	for (;;) {
+		uint64_t seq;
+		int64_t diff;
+
+		slot = &calllog_slots[pos & (CALLLOG_SLOTS - 1)];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		diff = (int64_t) (seq - pos);
+		if (!diff) {
+			if (__atomic_compare_exchange_n(&calllog_tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			} /* else, somebody else got it, and pos is now the current tail */
+		} else if (diff < 0) {
+			__atomic_fetch_add(&calllog_drops, 1, __ATOMIC_RELAXED); /* Full */
+			return;
+		} else {
+			pos = __atomic_load_n(&calllog_tail, __ATOMIC_RELAXED);
+		}
+	}
+	slot->rec = *rec;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/*! \brief Get the value of a field from an action's fields, e.g. Channel */
+static void action_field(const char *fields, const char *key, char *buf, size_t len)
+{
+	size_t keylen = strlen(key);
+	const char *s = fields;
+
+	while (s && *s) {
+		if (!strncasecmp(s, key, keylen) && s[keylen] == ':') {
+			const char *end = strchr(s, '\r');
+			snprintf(buf, len, "%.*s", end ? (int) (end - s - keylen - 1) : (int) strlen(s + keylen + 1), s + keylen + 1);
+			return;
+		}
+		s = strchr(s, '\n');
+		if (s) {
+			s++;
+		}
+	}
+	*buf = '\0';
+}
+
+/*! \brief Log an action that finished */
+static void calllog_action(int n, const char *action, const char *fields, int64_t queued, int64_t start, int64_t end, enum calllog_result result)
+{
+	struct calllog_record rec;
+
+	if (calllog_fd < 0) {
+		return;
+	}
+	memset(&rec, 0, sizeof(rec));
+	rec.kind = CALLLOG_ACTION;
+	rec.result = (uint8_t) result;
+	rec.server = (uint16_t) (lines[n].session - sessions);
+	rec.line = (uint32_t) n;
+	rec.queued = queued;
+	rec.start = start;
+	rec.end = end;
+	snprintf(rec.action, sizeof(rec.action), "%s", action);
+	action_field(fields, "Digit", rec.arg, sizeof(rec.arg));
+	action_field(fields, "Channel", rec.channel, sizeof(rec.channel));
+	calllog_add(&rec);
+}
+
+/*!
+ * \brief Log the outcome of an async originate, as an OriginateResponse timed from when the Originate was sent
+ * \note The Originate itself is logged when Asterisk accepts it, like any other action. Must be called with lines_lock held.
+ */
+static void calllog_originate_response(int n, int success, const char *channel)
+{
+	char fields[160];
+
+	snprintf(fields, sizeof(fields), "Channel:%s", channel);
+	calllog_action(n, "OriginateResponse", fields, lines[n].originate_queued, lines[n].originate_started, monotonic_ns(), success ? CALLLOG_SUCCESS : CALLLOG_FAILED);
+}
+
+/*! \brief Write out everything in the ring. Returns -1 if the log couldn't be written. */
+static int calllog_flush(void)
+{
+	struct calllog_record buf[256];
+	int count = 0, res = 0;
+
+	for (;;) {
+		struct calllog_slot *slot = &calllog_slots[calllog_head & (CALLLOG_SLOTS - 1)];
+		int empty = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != calllog_head + 1;
+		if (!empty) {
+			buf[count++] = slot->rec;
+			/* Free the slot for the next lap around the ring */
+			__atomic_store_n(&slot->seq, calllog_head + CALLLOG_SLOTS, __ATOMIC_RELEASE);
+			calllog_head++;
+		}
+		if (count && (empty || count == (int) (sizeof(buf) / sizeof(buf[0])))) {
+			size_t len = (size_t) count * sizeof(buf[0]);
+			char *s = (char *) buf;
+			while (len) {
+				ssize_t wres = write(calllog_fd, s, len);
+				if (wres < 0) {
+					if (errno == EINTR) {
+						continue;
+					}
+					res = -1;
+					break;
+				}
+				s += wres;
+				len -= (size_t) wres;
+			}
+			count = 0;
+		}
+		if (empty) {
+			return res;
+		}
+	}
+}
+
+static void *calllog_loop(void *varg)
+{
+	int failed = 0;
+
+	while (!__atomic_load_n(&calllog_shutdown, __ATOMIC_ACQUIRE)) {
+		usleep(CALLLOG_FLUSH_INTERVAL_US);
+		if (calllog_flush() && !failed) {
+			fprintf(stderr, "Failed to write to call log %s: %s\n", calllog_file, strerror(errno));
+			failed = 1; /* Don't keep complaining */
+		}
+	}
+	calllog_flush();
+	return NULL;
+}
+
+static int calllog_start(void)
+{
+	struct calllog_header header;
+	struct timespec mono, real;
+	uint64_t i;
+
+	if (!calllog_file[0]) {
+		return 0;
+	}
+	calllog_slots = calloc(CALLLOG_SLOTS, sizeof(*calllog_slots));
+	if (!calllog_slots) {
+		return -1;
+	}
+	for (i = 0; i < CALLLOG_SLOTS; i++) {
+		calllog_slots[i].seq = i;
+	}
+	calllog_fd = open(calllog_file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (calllog_fd < 0) {
+		fprintf(stderr, "Failed to open call log %s: %s\n", calllog_file, strerror(errno));
+		return -1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.kind = CALLLOG_HEADER;
+	header.version = CALLLOG_VERSION;
+	header.record_size = CALLLOG_RECORD_SIZE;
+	memcpy(header.magic, CALLLOG_MAGIC, sizeof(header.magic));
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	clock_gettime(CLOCK_REALTIME, &real);
+	header.monotonic = (int64_t) mono.tv_sec * 1000000000LL + mono.tv_nsec;
+	header.realtime = (int64_t) real.tv_sec * 1000000000LL + real.tv_nsec;
+	if (write(calllog_fd, &header, sizeof(header)) != sizeof(header)) {
+		fprintf(stderr, "Failed to write to call log %s: %s\n", calllog_file, strerror(errno));
+		close(calllog_fd);
+		calllog_fd = -1;
+		return -1;
+	}
+
+	if (pthread_create(&calllog_thread, NULL, calllog_loop, NULL)) {
+		fprintf(stderr, "Failed to create call log thread: %s\n", strerror(errno));
+		close(calllog_fd);
+		calllog_fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+/*! \brief Flush anything left and close the call log. Call after the pipeline has stopped, so nothing else gets logged. */
+static void calllog_stop(void)
+{
+	uint64_t drops;
+
+	if (calllog_fd < 0) {
+		return;
+	}
+	__atomic_store_n(&calllog_shutdown, 1, __ATOMIC_RELEASE);
+	pthread_join(calllog_thread, NULL);
+	close(calllog_fd);
+	calllog_fd = -1;
+	free(calllog_slots);
+	calllog_slots = NULL;
+
+	drops = __atomic_load_n(&calllog_drops, __ATOMIC_RELAXED);
+	if (drops) {
+		fprintf(stderr, "%lu call log record%s dropped, since the log couldn't keep up\n", (unsigned long) drops, drops == 1 ? "" : "s");
+	}
+}
+
+static const char *calllog_results[] = {
+	[CALLLOG_SUCCESS] = "ok",
+	[CALLLOG_FAILED] = "failed",
+	[CALLLOG_NO_RESPONSE] = "no response",
+};
+
+/*! \brief Quote a CSV field, if it needs it. buf must be at least 2 * strlen(s) + 3 bytes. */
+static const char *csv_escape(char *buf, const char *s)
+{
+	char *out = buf;
+
+	if (!strpbrk(s, ",\"\r\n")) {
+		return s;
+	}
+	*out++ = '"';
+	for (; *s; s++) {
+		if (*s == '"') {
+			*out++ = '"';
+		}
+		*out++ = *s;
+	}
+	*out++ = '"';
+	*out = '\0';
+	return buf;
+}
+
+/*! \brief Escape a string for use in a JSON string. buf must be at least 6 * strlen(s) + 1 bytes. */
+static const char *json_escape(char *buf, const char *s)
+{
+	char *out = buf;
+
+	for (; *s; s++) {
+		unsigned char c = (unsigned char) *s;
+		if (c == '"' || c == '\\') {
+			*out++ = '\\';
+			*out++ = (char) c;
+		} else if (c < 0x20) {
+			out += sprintf(out, "\\u%04x", c);
+		} else {
+			*out++ = (char) c;
+		}
+	}
+	*out = '\0';
+	return buf;
+}
+
+/*! \brief Convert a call log to CSV or JSON (one object per line) on STDOUT */
+static int calllog_convert(const char *filename, int json)
+{
+	union {
+		struct calllog_header header;
+		struct calllog_record rec;
+	} buf;
+	int64_t monotonic = 0, realtime = 0;
+	int fd, res = 0;
+	ssize_t len;
+
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+	if (!json) {
+		printf("time,line,server,action,arg,channel,result,queued_ms,latency_ms\n");
+	}
+	while ((len = read(fd, &buf, sizeof(buf))) == sizeof(buf)) {
+		struct calllog_record *rec = &buf.rec;
+		char action[6 * sizeof(rec->action)], arg[6 * sizeof(rec->arg)], channel[6 * sizeof(rec->channel)];
+		char timestr[32];
+		time_t secs;
+		struct tm tm;
+		int64_t wall;
+
+		if (buf.header.kind == CALLLOG_HEADER) {
+			if (memcmp(buf.header.magic, CALLLOG_MAGIC, sizeof(buf.header.magic)) || buf.header.version != CALLLOG_VERSION || buf.header.record_size != CALLLOG_RECORD_SIZE) {
+				fprintf(stderr, "%s is not a call log, or is from an incompatible version\n", filename);
+				res = -1;
+				break;
+			}
+			monotonic = buf.header.monotonic;
+			realtime = buf.header.realtime;
+			continue;
+		} else if (rec->kind != CALLLOG_ACTION || !realtime) {
+			fprintf(stderr, "Invalid record in %s\n", filename);
+			res = -1;
+			break;
+		}
+		/* Make sure strings are terminated, in case the log is corrupted */
+		rec->action[sizeof(rec->action) - 1] = rec->arg[sizeof(rec->arg) - 1] = rec->channel[sizeof(rec->channel) - 1] = '\0';
+
+		wall = realtime + (rec->start - monotonic);
+		secs = (time_t) (wall / 1000000000LL);
+		gmtime_r(&secs, &tm);
+		strftime(timestr, sizeof(timestr), "%Y-%m-%dT%H:%M:%S", &tm);
+
+		if (json) {
+			printf("{\"time\":\"%s.%06dZ\",\"line\":%u,\"server\":%u,\"action\":\"%s\",\"arg\":\"%s\",\"channel\":\"%s\",\"result\":\"%s\",\"queued_ms\":%.3f,\"latency_ms\":%.3f}\n",
+				timestr, (int) (wall % 1000000000LL / 1000), rec->line, rec->server,
+				json_escape(action, rec->action), json_escape(arg, rec->arg), json_escape(channel, rec->channel),
+				rec->result <= CALLLOG_NO_RESPONSE ? calllog_results[rec->result] : "unknown",
+				(double) (rec->start - rec->queued) / 1000000.0, (double) (rec->end - rec->start) / 1000000.0);
+		} else {
+			printf("%s.%06dZ,%u,%u,%s,%s,%s,%s,%.3f,%.3f\n",
+				timestr, (int) (wall % 1000000000LL / 1000), rec->line, rec->server,
+				csv_escape(action, rec->action), csv_escape(arg, rec->arg), csv_escape(channel, rec->channel),
+				rec->result <= CALLLOG_NO_RESPONSE ? calllog_results[rec->result] : "unknown",
+				(double) (rec->start - rec->queued) / 1000000.0, (double) (rec->end - rec->start) / 1000000.0);
+		}
+	}
+	if (len > 0 && len != sizeof(buf)) {
+		fprintf(stderr, "%s ends with a partial record\n", filename);
+		res = -1;
+	}
+	close(fd);
+	return res;
+}
+
+/*
+ * Action pipeline
+ *
+ * CAMI actions are blocking, so rather than doing them one at a time on the input thread,
+ * actions can be queued here and are executed by a pool of worker threads.
+ * Each connection has its own pool, and the window is divided between a server's connections,
+ * so it bounds the number of actions in flight to each server at once.
+ * Actions for the same line are always executed in the order they were queued
+ * (so DTMF digits come out in the right order), but different lines proceed in parallel.
+ */
+
+struct ami_batch;
+
+struct ami_job {
+	struct ami_job *next;
+	struct ami_batch *batch;	/* Batch this action belongs to, if any */
+	/*! Called by the worker when the action finishes (resp is NULL if there was no response).
+	 * Returns 0 if the action should be counted as successful, -1 if not. */
+	int (*done)(struct ami_session *ami, struct ami_job *job, struct ami_response *resp);
+	int line;
+	enum stat_type stat;
+	int64_t queued;				/* When it was queued, for the call log */
+	int64_t started;			/* When it was sent */
+	unsigned int interrupted:1;	/* The connection dropped before the response, so it's not known if the action happened */
+	char action[24];
+	char fields[256];
+};
+
+/*! \brief A group of actions that can be waited on together */
+struct ami_batch {
+	int pending;	/* Actions not yet finished */
+	int ok;			/* Actions that succeeded */
+	int failed;		/* Actions that failed */
+	int refs;		/* The submitter holds one reference, and each unfinished action holds one */
+};
+
+static pthread_mutex_t pipeline_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pipeline_done_cond; /* Signaled when an action finishes. Uses CLOCK_MONOTONIC, for timed waits. */
+static int jobs_outstanding = 0;
+static int pipeline_shutdown = 0;
+static int pipeline_window = DEFAULT_WINDOW;
+
+/*! \brief Add a line to the ready list. Must be called with pipeline_lock held. */
+static void line_ready(int n)
+{
+	struct ami_conn *conn = lines[n].conn;
+
+	lines[n].next_ready = 0;
+	if (conn->ready_tail) {
+		lines[conn->ready_tail].next_ready = n;
+	} else {
+		conn->ready_head = n;
+	}
+	conn->ready_tail = n;
+	pthread_cond_signal(&conn->pipeline_cond);
+}
+
+/*! \brief Account for an action that's done (or won't be done) and free it. Must be called with pipeline_lock held. */
+static void job_finish(struct ami_job *job, int success)
+{
+	int n = job->line;
+
+	if (job->batch) {
+		struct ami_batch *batch = job->batch;
+		batch->pending--;
+		if (success) {
+			batch->ok++;
+		} else {
+			batch->failed++;
+		}
+		if (!--batch->refs) {
+			free(batch); /* The submitter gave up waiting on it */
+		}
+	}
+	free(job);
+	lines[n].queued--;
+	jobs_outstanding--;
+}
+
+/*!
+ * \brief Throw away the actions queued for a line that haven't started yet. Must be called with pipeline_lock held.
+ * \note The line must not be on the ready list, or must be removed from it by the caller.
+ * \return Number of actions discarded
+ */
+static int pipeline_discard(int n)
+{
+	int count = 0;
+
+	while (lines[n].jobs) {
+		struct ami_job *job = lines[n].jobs;
+		lines[n].jobs = job->next;
+		job_finish(job, 0);
+		count++;
+	}
+	lines[n].jobs_last = NULL;
+	return count;
+}
+
+/*! \brief Whether an action can be sent again if we don't know if it happened */
+static int action_repeatable(const struct ami_job *job)
+{
+	return job->stat != STAT_ORIGINATE && job->stat != STAT_SENDFLASH && job->stat != STAT_PLAYDTMF;
+}
+
+static void *pipeline_worker(void *varg)
+{
+	struct ami_conn *conn = varg;
+
+	for (;;) {
+		struct ami_job *job;
+		struct ami_response *resp;
+		struct ami_session *ami;
+		int64_t start, end;
+		int n, success;
+
+		pthread_mutex_lock(&pipeline_lock);
+		/* While disconnected, leave actions queued until we reconnect */
+		while ((!conn->ready_head || conn->down) && !pipeline_shutdown) {
+			pthread_cond_wait(&conn->pipeline_cond, &pipeline_lock);
+		}
+		if (!conn->ready_head || conn->down) {
+			pthread_mutex_unlock(&pipeline_lock);
+			break;
+		}
+		ami = conn->ami; /* May be a new session, if we reconnected */
+		/* Take the next action for the first ready line */
+		n = conn->ready_head;
+		conn->ready_head = lines[n].next_ready;
+		if (!conn->ready_head) {
+			conn->ready_tail = 0;
+		}
+		job = lines[n].jobs;
+		lines[n].jobs = job->next;
+		if (!lines[n].jobs) {
+			lines[n].jobs_last = NULL;
+		}
+		lines[n].busy = 1;
+		conn->inflight++;
+		pthread_mutex_unlock(&pipeline_lock);
+
+		start = job->started = monotonic_ns();
+		resp = ami_action(ami, job->action, "%s", job->fields);
+		end = monotonic_ns();
+		if (!resp) {
+			pthread_mutex_lock(&pipeline_lock);
+			if (conn->down && !action_repeatable(job)) {
+				/* It may well have happened, and doing it again could make a second call, or flash twice.
+				 * Fail it, and leave it to the resync after reconnecting to work out where the line stands. */
+				job->interrupted = 1;
+			} else if (conn->down) {
+				/* The connection dropped while this action was in progress, so put it back
+				 * at the front of the line's queue, to be retried once we've reconnected. */
+				job->next = lines[n].jobs;
+				lines[n].jobs = job;
+				if (!lines[n].jobs_last) {
+					lines[n].jobs_last = job;
+				}
+				lines[n].busy = 0;
+				line_ready(n);
+				conn->inflight--;
+				pthread_cond_broadcast(&pipeline_done_cond);
+				pthread_mutex_unlock(&pipeline_lock);
+				continue;
+			}
+			pthread_mutex_unlock(&pipeline_lock);
+		}
+		stats_record(job->stat, end - start, resp && resp->success);
+		calllog_action(n, job->action, job->fields, job->queued, start, end, !resp ? CALLLOG_NO_RESPONSE : resp->success ? CALLLOG_SUCCESS : CALLLOG_FAILED);
+		if (job->done) {
+			success = !job->done(ami, job, resp);
+		} else {
+			success = resp && resp->success;
+			if (!success) {
+				fprintf(stderr, "%s failed on line %d\n", job->action, n);
+			}
+		}
+		if (resp) {
+			ami_resp_free(resp);
+		}
+
+		pthread_mutex_lock(&pipeline_lock);
+		job_finish(job, success);
+		lines[n].busy = 0;
+		conn->inflight--;
+		if (lines[n].jobs) {
+			line_ready(n);
+		}
+		pthread_cond_broadcast(&pipeline_done_cond);
+		pthread_mutex_unlock(&pipeline_lock);
+	}
+
+	return NULL;
+}
+
+static struct ami_batch *batch_new(void)
+{
+	struct ami_batch *batch = calloc(1, sizeof(*batch));
+	if (batch) {
+		batch->refs = 1;
+	}
+	return batch;
+}
+
+/*!
+ * \brief Wait for all the actions in a batch to finish, without releasing it
+ * \param batch
+ * \param timeout_ms Maximum time to wait, or -1 to wait forever
+ * \return Number of actions that had not finished when the timeout expired
+ */
+static int batch_wait_for(struct ami_batch *batch, int timeout_ms)
+{
+	struct timespec deadline;
+	int pending;
+
+	if (timeout_ms >= 0) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+
+	pthread_mutex_lock(&pipeline_lock);
+	while (batch->pending) {
+		if (timeout_ms < 0) {
+			pthread_cond_wait(&pipeline_done_cond, &pipeline_lock);
+		} else if (pthread_cond_timedwait(&pipeline_done_cond, &pipeline_lock, &deadline) == ETIMEDOUT) {
+			break;
+		}
+	}
+	pending = batch->pending;
+	pthread_mutex_unlock(&pipeline_lock);
+	return pending;
+}
+
+/*!
+ * \brief Release a batch, whether or not its actions have finished
+ * \param batch
+ * \param[out] ok Number of actions that succeeded
+ * \param[out] failed Number of actions that failed
+ * \return Number of actions that had not finished yet
+ */
+static int batch_release(struct ami_batch *batch, int *ok, int *failed)
+{
+	int pending;
+
+	pthread_mutex_lock(&pipeline_lock);
+	pending = batch->pending;
+	if (ok) {
+		*ok = batch->ok;
+	}
+	if (failed) {
+		*failed = batch->failed;
+	}
+	if (!--batch->refs) {
+		free(batch);
+	} /* else, the last action to finish will free it */
+	pthread_mutex_unlock(&pipeline_lock);
+	return pending;
+}
+
+typedef int (*job_done_cb)(struct ami_session *ami, struct ami_job *job, struct ami_response *resp);
+
+static int pipeline_submit(int n, struct ami_batch *batch, job_done_cb done, const char *action, const char *fmt, ...) __attribute__ ((format (printf, 5, 6)));
+
+/*!
+ * \brief Queue an action for a line
+ * \param n Line number
+ * \param batch Batch to add the action to, NULL if none
+ * \param done Callback to execute (on a worker thread) when the action finishes. If NULL, failures are logged.
+ * \param action AMI action name
+ * \param fmt Format string for the action's fields
+ * \retval 0 on success, -1 on failure
+ */
+static int pipeline_submit(int n, struct ami_batch *batch, job_done_cb done, const char *action, const char *fmt, ...)
+{
+	struct ami_job *job;
+	va_list ap;
+
+	job = calloc(1, sizeof(*job));
+	if (!job) {
+		return -1;
+	}
+	job->line = n;
+	job->batch = batch;
+	job->done = done;
+	snprintf(job->action, sizeof(job->action), "%s", action);
+	job->stat = stat_type(action);
+	job->queued = monotonic_ns();
+	va_start(ap, fmt);
+	vsnprintf(job->fields, sizeof(job->fields), fmt, ap);
+	va_end(ap);
+
+	pthread_mutex_lock(&pipeline_lock);
+	if (lines[n].jobs_last) {
+		lines[n].jobs_last->next = job;
+	} else {
+		lines[n].jobs = job;
+		if (!lines[n].busy) {
+			line_ready(n);
+		}
+	}
+	lines[n].jobs_last = job;
+	lines[n].queued++;
+	jobs_outstanding++;
+	if (batch) {
+		batch->pending++;
+		batch->refs++;
+	}
+	pthread_mutex_unlock(&pipeline_lock);
+	return 0;
+}
+
+static int pipeline_start(void)
+{
+	pthread_condattr_t attr;
+	int i, j;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&pipeline_done_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	for (i = 0; i < num_sessions; i++) {
+		for (j = 0; j < sessions[i].nconns; j++) {
+			struct ami_conn *conn = &sessions[i].conns[j];
+			/* Split the window between the connections, but every connection needs at least one worker */
+			int nthreads = pipeline_window / sessions[i].nconns + (j < pipeline_window % sessions[i].nconns);
+			if (!nthreads) {
+				nthreads = 1;
+			}
+			conn->threads = calloc(nthreads, sizeof(pthread_t));
+			if (!conn->threads) {
+				return -1;
+			}
+			for (conn->nthreads = 0; conn->nthreads < nthreads; conn->nthreads++) {
+				if (pthread_create(&conn->threads[conn->nthreads], NULL, pipeline_worker, conn)) {
+					fprintf(stderr, "Failed to create pipeline thread: %s\n", strerror(errno));
+					return -1;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+/*! \brief Finish any outstanding actions and stop the pipeline */
+static void pipeline_stop(void)
+{
+	int i, j, k, n, discarded = 0;
+
+	pthread_mutex_lock(&pipeline_lock);
+	pipeline_shutdown = 1;
+	for (i = 0; i < num_sessions; i++) {
+		for (j = 0; j < sessions[i].nconns; j++) {
+			pthread_cond_broadcast(&sessions[i].conns[j].pipeline_cond);
+		}
+	}
+	pthread_mutex_unlock(&pipeline_lock);
+	for (i = 0; i < num_sessions; i++) {
+		for (j = 0; j < sessions[i].nconns; j++) {
+			struct ami_conn *conn = &sessions[i].conns[j];
+			for (k = 0; k < conn->nthreads; k++) {
+				pthread_join(conn->threads[k], NULL);
+			}
+			free(conn->threads);
+			conn->threads = NULL;
+			conn->nthreads = 0;
+		}
+	}
+	/* Actions for lines on connections that are still down never got to run */
+	pthread_mutex_lock(&pipeline_lock);
+	for (n = 1; n <= num_lines; n++) {
+		discarded += pipeline_discard(n);
+	}
+	pthread_mutex_unlock(&pipeline_lock);
+	if (discarded) {
+		fprintf(stderr, "Discarded %d action%s that could not be sent\n", discarded, discarded == 1 ? "" : "s");
+	}
+	pthread_cond_destroy(&pipeline_done_cond);
+}
+
+/*!
+ * \brief Discard every queued action that hasn't started yet. Actions in progress still finish.
+ * \return Number of actions discarded
+ */
+static int pipeline_cancel(void)
+{
+	int i, j, n, discarded = 0;
+
+	pthread_mutex_lock(&pipeline_lock);
+	for (i = 0; i < num_sessions; i++) {
+		for (j = 0; j < sessions[i].nconns; j++) {
+			sessions[i].conns[j].ready_head = sessions[i].conns[j].ready_tail = 0;
+		}
+	}
+	for (n = 1; n <= num_lines; n++) {
+		discarded += pipeline_discard(n);
+	}
+	pthread_cond_broadcast(&pipeline_done_cond);
+	pthread_mutex_unlock(&pipeline_lock);
+	return discarded;
+}
+
+/*
+ * Reconnecting
+ *
+ * If a connection drops, actions for its lines stay queued (so a script just pauses),
+ * while the reconnect thread reconnects with exponential backoff. Once the first connection
+ * to a server is back, the line state is rebuilt from a snapshot of the server's channels,
+ * since any events during the outage were missed.
+ */
+
+#define RECONNECT_MIN_DELAY_MS 500
+#define RECONNECT_MAX_DELAY_MS 30000
+
+static pthread_cond_t reconnect_cond; /* Signaled when a connection drops. Uses CLOCK_MONOTONIC. Protected by pipeline_lock */
+static pthread_t reconnect_thread;
+static int reconnect_started = 0;
+static int reconnect_shutdown = 0;
+
+static void disconnect_callback(struct ami_session *ami)
+{
+	struct ami_conn *conn = conn_from_ami(ami);
+
+	if (!conn) {
+		return; /* A session we already gave up on */
+	}
+	pthread_mutex_lock(&pipeline_lock);
+	if (!reconnect_shutdown && !conn->down) {
+		conn->down = 1;
+		conn->down_since = monotonic_ns();
+		fprintf(stderr, "\nLost connection %d to %s, reconnecting...\n", conn->index + 1, conn->session->name);
+		pthread_cond_signal(&reconnect_cond);
+	}
+	pthread_mutex_unlock(&pipeline_lock);
+}
+
+/*! \brief Escape the characters in a string that are special in a regular expression */
+static void regex_escape(char *buf, size_t len, const char *s)
+{
+	char *out = buf, *end = buf + len - 1;
+
+	for (; *s && out < end; s++) {
+		if (strchr(".[]()*+?{}|^$\\", *s)) {
+			if (out + 1 >= end) {
+				break;
+			}
+			*out++ = '\\';
+		}
+		*out++ = *s;
+	}
+	*out = '\0';
+}
+
+/*!
+ * \brief Get the channel to give Hangup for a line
+ * \note If we never found out the line's channel (e.g. it wasn't found after the Originate), try the channel index again,
+ *       and failing that, hang up whatever channel the line's device has, using a regex (which Hangup accepts as /regex/).
+ */
+static const char *line_hangup_channel(int n, char *buf, size_t len)
+{
+	char regex[160];
+
+	if (lines[n].channel[0] || !chan_index_find(lines[n].session, lines[n].devicename, lines[n].channel, sizeof(lines[n].channel))) {
+		return lines[n].channel;
+	}
+	regex_escape(regex, sizeof(regex), lines[n].devicename);
+	snprintf(buf, len, "/^%s-/", regex);
+	return buf;
+}
+
+/* How long to wait for lines to hang up when hanging up all lines */
+#define HANGUP_ALL_TIMEOUT_MS 5000
+
+static int hangup_done(struct ami_session *ami, struct ami_job *job, struct ami_response *resp)
+{
+	if (!resp || !resp->success) {
+		fprintf(stderr, "Failed to go on hook on line %d\n", job->line);
+		return -1;
+	}
+	pthread_mutex_lock(&lines_lock);
+	line_set_offhook(job->line, 0);
+	pthread_mutex_unlock(&lines_lock);
+	return 0;
+}
+
+static int hangup_all_done(struct ami_session *ami, struct ami_job *job, struct ami_response *resp)
+{
+	int res = hangup_done(ami, job, resp);
+
+	pthread_mutex_lock(&lines_lock);
+	lines[job->line].hanging_up = 0;
+	pthread_mutex_unlock(&lines_lock);
+	if (!res) {
+		fprintf(stderr, "Hung up line %d\n", job->line);
+	}
+	return res;
+}
+
+/*! \brief Hang up all off-hook lines at once */
+static void hangup_all(void)
+{
+	struct ami_batch *batch;
+	int i, ok, failed, pending, cancelled;
+
+	batch = batch_new();
+	if (!batch) {
+		return;
+	}
+
+	/* Queue up all the hangups, so they happen in parallel.
+	 * If a line still has actions queued, the hangup will happen after those finish. */
+	pthread_mutex_lock(&lines_lock);
+	for (i = 1; i <= num_lines; i++) {
+		lines[i].hanging_up = lines[i].offhook;
+	}
+	pthread_mutex_unlock(&lines_lock);
+	for (i = 1; i <= num_lines; i++) {
+		if (lines[i].hanging_up) {
+			char buf[192];
+			pipeline_submit(i, batch, hangup_all_done, "Hangup", "Channel:%s\r\nCause:%d", line_hangup_channel(i, buf, sizeof(buf)), 16);
+		}
+	}
+
+	/* Failures are reported by the callback as they happen, so all that's left is to report the ones that never finished */
+	batch_wait_for(batch, HANGUP_ALL_TIMEOUT_MS);
+	pending = batch_release(batch, &ok, &failed);
+	if (pending) {
+		pthread_mutex_lock(&lines_lock);
+		for (i = 1; i <= num_lines; i++) {
+			if (lines[i].hanging_up) {
+				fprintf(stderr, "Line %d did not hang up within %d ms\n", i, HANGUP_ALL_TIMEOUT_MS);
+				lines[i].hanging_up = 0;
+			}
+		}
+		pthread_mutex_unlock(&lines_lock);
+		/* If the server is hung, don't wait for everything still queued to drain one timeout at a time */
+		cancelled = pipeline_cancel();
+		if (cancelled) {
+			fprintf(stderr, "Cancelled %d queued action%s\n", cancelled, cancelled == 1 ? "" : "s");
+		}
+	}
+	if (ok + failed + pending) {
+		fprintf(stderr, "Hung up %d line%s (%d failed, %d timed out)\n", ok, ok == 1 ? "" : "s", failed, pending);
+	}
+}
+
+static volatile sig_atomic_t got_sigint = 0;
+static int sigint_pipe[2] = { -1, -1 };
+
+static void sigint_handler(int num)
+{
+	/* Don't do anything here that isn't async signal safe. Just wake up the input thread, which will clean up. */
+	got_sigint = 1;
+	if (write(sigint_pipe[1], "", 1) < 0) {
+		/* Nothing we can do */
+	}
+}
+
+static int find_channel(struct ami_session *ami, int n)
+{
+	int i, found = 0;
+	struct ami_response *resp;
+	const char *prefix = lines[n].devicename;
+	int prefixlen;
+	int64_t start;
+
+	/* Originate action doesn't give us the new channel name, so try to find it.
+	 * Normally, the channel index will already know about it from the Newchannel event. */
+	if (!chan_index_find(lines[n].session, prefix, lines[n].channel, sizeof(lines[n].channel))) {
+		return 0;
+	}
+
+	/* If we didn't see the event (e.g. event permissions are missing for this user),
+	 * fall back to dumping all the channels, assuming there's only one channel with the prefix of the device name */
+	start = monotonic_ns();
+	resp = ami_action_show_channels(ami);
+	stats_record(STAT_SHOWCHANNELS, monotonic_ns() - start, resp && resp->success);
+	if (!resp) {
+		fprintf(stderr, "Failed to show channels\n");
+		return -1;
+	}
+
+	prefixlen = strlen(prefix);
+	for (i = 1; i < resp->size - 1; i++) {
+		const char *channel = ami_keyvalue(resp->events[i], "Channel");
+		if (!strncmp(channel, prefix, prefixlen)) {
+			strncpy(lines[n].channel, channel, sizeof(lines[n].channel) - 1);
+			found = 1;
+			break;
+		}
+	}
+	if (!found) {
+		fprintf(stderr, "Failed to find channel for %s\n", lines[n].devicename);
+	}
+	return found ? 0 : -1;
+}
+
+#define ESS(x) ((x) == 1 ? "" : "s")
+
+#define ltrim(s) \
+	while (isspace(*s)) { \
+		s++; \
+	}
+
+static char *trim(char *s)
+{
+	char *end;
+
+	ltrim(s);
+	end = s + strlen(s);
+	while (end > s && isspace(*(end - 1))) {
+		*--end = '\0';
+	}
+	return s;
+}
+
+/*! \brief Whether a line is off hook, so actions can be done on it. If not, and verbose is set, say why. */
+static int line_active(int n, int verbose)
+{
+	if (lines[n].originating) {
+		if (verbose) {
+			fprintf(stderr, "Line %d is still going off hook\n", n);
+		}
+		return 0;
+	}
+	if (!lines[n].offhook) {
+		if (verbose) {
+			fprintf(stderr, "Can't do this action on on-hook line\n");
+		}
+		return 0;
+	}
+	return 1;
+}
+
+/*!
+ * \brief The connection dropped during an Originate, so we don't know if the call was made
+ * \param load_call Whether the call is for the load generator, which then hears how it went when the resync settles it
+ * \note The line is left originating, for the resync after reconnecting to complete (or fail) it from the channels it finds.
+ */
+static void originate_interrupted(int n, int load_call)
+{
+	pthread_mutex_lock(&lines_lock);
+	line_set_originating(n, 1);
+	lines[n].actionid = 0;
+	if (load_call) {
+		lines[n].load_call = 1;
+	}
+	pthread_mutex_unlock(&lines_lock);
+	fprintf(stderr, "Lost the connection while going off hook on line %d, will check once reconnected\n", n);
+}
+
+static int originate_done(struct ami_session *ami, struct ami_job *job, struct ami_response *resp)
+{
+	int n = job->line;
+
+	if (job->interrupted) {
+		originate_interrupted(n, 0);
+		return -1;
+	} else if (!resp || !resp->success) {
+		fprintf(stderr, "Failed to go off hook on line %d\n", n);
+		return -1;
+	}
+	pthread_mutex_lock(&lines_lock);
+	line_set_offhook(n, 1);
+	lines[n].channel[0] = '\0'; /* Whatever it was is from the last call */
+	pthread_mutex_unlock(&lines_lock);
+	return find_channel(ami, n);
+}
+
+static int originate_async_done(struct ami_session *ami, struct ami_job *job, struct ami_response *resp)
+{
+	int n = job->line;
+
+	if (job->interrupted) {
+		originate_interrupted(n, 0);
+		return -1;
+	} else if (!resp || !resp->success) {
+		pthread_mutex_lock(&lines_lock);
+		originate_complete(n, 0, "");
+		pthread_mutex_unlock(&lines_lock);
+		return -1;
+	}
+	pthread_mutex_lock(&lines_lock);
+	lines[n].originate_queued = job->queued;
+	lines[n].originate_started = job->started;
+	pthread_mutex_unlock(&lines_lock);
+	originate_queued(n, resp->actionid);
+	return 0;
+}
+
+static int flash_done(struct ami_session *ami, struct ami_job *job, struct ami_response *resp)
+{
+	if (!resp || !resp->success) {
+		fprintf(stderr, "Failed to send flash on line %d\n", job->line);
+		return -1;
+	}
+	return 0;
+}
+
+static int play_done(struct ami_session *ami, struct ami_job *job, struct ami_response *resp)
+{
+	if (!resp || !resp->success) {
+		fprintf(stderr, "Failed to play audio on line %d\n", job->line);
+		return -1;
+	}
+	return 0;
+}
+
+static int answer_done(struct ami_session *ami, struct ami_job *job, struct ami_response *resp)
+{
+	int n = job->line;
+	int64_t ringing;
+
+	pthread_mutex_lock(&lines_lock);
+	line_set_answering(n, 0);
+	ringing = monotonic_ns() - lines[n].ring_start;
+	if (!resp || !resp->success || !lines[n].inbound[0]) {
+		pthread_mutex_unlock(&lines_lock);
+		stats_record_failure(STAT_RING_ANSWER);
+		fprintf(stderr, "Failed to answer line %d\n", n);
+		return -1;
+	}
+	strcpy(lines[n].channel, lines[n].inbound);
+	lines[n].inbound[0] = '\0';
+	line_set_offhook(n, 1);
+	pthread_mutex_unlock(&lines_lock);
+	stats_record(STAT_RING_ANSWER, ringing, 1);
+	fprintf(stderr, "Line %d answered after ringing for %.1f ms\n", n, (double) ringing / 1000000.0);
+	return 0;
+}
+
+/*!
+ * \brief Answer the inbound call ringing a line, by redirecting it to the same dialplan our own calls go to
+ * \retval 0 if queued, 1 if the line was skipped, -1 on failure
+ */
+static int line_answer(int n, struct ami_batch *batch, int verbose)
+{
+	char channel[sizeof(lines[n].inbound)];
+
+	pthread_mutex_lock(&lines_lock);
+	if (!lines[n].inbound[0] || lines[n].answering) {
+		pthread_mutex_unlock(&lines_lock);
+		if (verbose) {
+			fprintf(stderr, "Line %d is not ringing\n", n);
+		}
+		return 1;
+	}
+	if (lines[n].offhook || lines[n].originating) {
+		pthread_mutex_unlock(&lines_lock);
+		if (verbose) {
+			fprintf(stderr, "Line %d is already off hook (flash to answer a waiting call)\n", n);
+		}
+		return 1;
+	}
+	line_set_answering(n, 1);
+	strcpy(channel, lines[n].inbound);
+	pthread_mutex_unlock(&lines_lock);
+
+	return pipeline_submit(n, batch, answer_done, "Redirect", "Channel:%s\r\nContext:%s\r\nExten:%s\r\nPriority:%s", channel, lines[n].dialcontext, lines[n].dialexten, "1");
+}
+
+/*
+ * Line settings
+ *
+ * What each line dials, and where its calls are connected to locally. The defaults are the settings at the top
+ * of this file, which can be changed for every line in the [lines] section of the config file, or for some lines
+ * in [lines N] or [lines N-M] sections. The device, dial string, context and extension of each line are
+ * built once at startup, so line commands just use them.
+ */
+
+#define LINE_SET_TECH (1 << 0)
+#define LINE_SET_PEER (1 << 1)
+#define LINE_SET_PLAR (1 << 2)
+#define LINE_SET_CONTEXT (1 << 3)
+#define LINE_SET_EXTEN (1 << 4)
+
+struct line_settings {
+	int first;				/* Lines these settings apply to */
+	int last;
+	unsigned int set;		/* Which settings were given (LINE_SET_*) */
+	char tech[16];
+	char peer[32];
+	char plar[16];			/* Empty to dial the device directly */
+	char context[48];
+	char exten[24];
+};
+
+static struct line_settings line_defaults = {
+	.set = LINE_SET_TECH | LINE_SET_PEER | LINE_SET_PLAR | LINE_SET_CONTEXT | LINE_SET_EXTEN,
+	.tech = LINE_TECH,
+	.peer = PEER_PREFIX,
+	.plar = PLAR_CODE,
+	.context = PLAR_DIALPLAN_CONTEXT,
+	.exten = PLAR_DIALPLAN_EXTEN,
+};
+
+static struct line_settings *line_overrides = NULL;	/* [lines N-M] sections, in the order they appear */
+static int num_line_overrides = 0;
+
+/*!
+ * \brief Start a [lines N-M] config section
+ * \return Settings for the section, or NULL on failure
+ */
+static struct line_settings *line_settings_add(const char *range)
+{
+	struct line_settings *settings;
+	char *end;
+	long first, last;
+
+	first = last = strtol(range, &end, 10);
+	if (*end == '-') {
+		last = strtol(end + 1, &end, 10);
+	}
+	if (end == range || *end || first < 1 || last < first || last > MAX_LINES) {
+		fprintf(stderr, "Invalid line range '%s'\n", range);
+		return NULL;
+	}
+	settings = realloc(line_overrides, (num_line_overrides + 1) * sizeof(*settings));
+	if (!settings) {
+		return NULL;
+	}
+	line_overrides = settings;
+	settings = &line_overrides[num_line_overrides++];
+	memset(settings, 0, sizeof(*settings));
+	settings->first = (int) first;
+	settings->last = (int) last;
+	return settings;
+}
+
+/*!
+ * \brief Set a setting in a [lines] section
+ * \retval 0 on success, 1 if unknown, -1 if invalid
+ */
+static int line_settings_set(struct line_settings *settings, const char *key, const char *value)
+{
+	char *field;
+	size_t size;
+	unsigned int flag;
+
+	if (!strcasecmp(key, "tech")) {
+		field = settings->tech;
+		size = sizeof(settings->tech);
+		flag = LINE_SET_TECH;
+	} else if (!strcasecmp(key, "peer")) {
+		field = settings->peer;
+		size = sizeof(settings->peer);
+		flag = LINE_SET_PEER;
+	} else if (!strcasecmp(key, "plar")) {
+		field = settings->plar;
+		size = sizeof(settings->plar);
+		flag = LINE_SET_PLAR;
+	} else if (!strcasecmp(key, "context")) {
+		field = settings->context;
+		size = sizeof(settings->context);
+		flag = LINE_SET_CONTEXT;
+	} else if (!strcasecmp(key, "exten")) {
+		field = settings->exten;
+		size = sizeof(settings->exten);
+		flag = LINE_SET_EXTEN;
+	} else {
+		return 1;
+	}
+	if (strlen(value) >= size) {
+		fprintf(stderr, "Value for %s is too long (max %lu characters)\n", key, (unsigned long) size - 1);
+		return -1;
+	} else if (!*value && flag != LINE_SET_PLAR) {
+		fprintf(stderr, "Value for %s can't be empty\n", key);
+		return -1;
+	}
+	strcpy(field, value);
+	settings->set |= flag;
+	return 0;
+}
+
+/*! \brief Fill in the device and dial strings, context, and extension for a line */
+static void line_setup(int n)
+{
+	const struct line_settings *tech = &line_defaults, *peer = &line_defaults, *plar = &line_defaults, *context = &line_defaults, *exten = &line_defaults;
+	int i;
+
+	/* Later sections take precedence over earlier ones */
+	for (i = 0; i < num_line_overrides; i++) {
+		const struct line_settings *settings = &line_overrides[i];
+		if (n < settings->first || n > settings->last) {
+			continue;
+		}
+		if (settings->set & LINE_SET_TECH) {
+			tech = settings;
+		}
+		if (settings->set & LINE_SET_PEER) {
+			peer = settings;
+		}
+		if (settings->set & LINE_SET_PLAR) {
+			plar = settings;
+		}
+		if (settings->set & LINE_SET_CONTEXT) {
+			context = settings;
+		}
+		if (settings->set & LINE_SET_EXTEN) {
+			exten = settings;
+		}
+	}
+
+	snprintf(lines[n].devicename, sizeof(lines[n].devicename), "%s/%s%d", tech->tech, peer->peer, n);
+	if (plar->plar[0]) {
+		snprintf(lines[n].dialstr, sizeof(lines[n].dialstr), "%s/%s@%s%d", tech->tech, plar->plar, peer->peer, n);
+	} else {
+		snprintf(lines[n].dialstr, sizeof(lines[n].dialstr), "%s", lines[n].devicename);
+	}
+	snprintf(lines[n].dialcontext, sizeof(lines[n].dialcontext), "%s", context->context);
+	snprintf(lines[n].dialexten, sizeof(lines[n].dialexten), "%s", exten->exten);
+}
+
+/*! \brief Build the index used to map channels in events to lines */
+static int line_index_build(void)
+{
+	unsigned int size = 1;
+	int n;
+
+	while (size < (unsigned int) num_lines) {
+		size <<= 1;
+	}
+	line_index = calloc(size, sizeof(int));
+	if (!line_index) {
+		return -1;
+	}
+	line_index_mask = size - 1;
+	for (n = 0; n < num_line_overrides; n++) {
+		if (line_overrides[n].last > num_lines) {
+			fprintf(stderr, "Lines %d-%d in config file are out of range (there are %d lines)\n", line_overrides[n].first, line_overrides[n].last, num_lines);
+			return -1;
+		}
+	}
+	for (n = 1; n <= num_lines; n++) {
+		unsigned int bucket;
+		line_setup(n);
+		bucket = string_hash(lines[n].devicename, strlen(lines[n].devicename)) & line_index_mask;
+		lines[n].next_index = line_index[bucket];
+		line_index[bucket] = n;
+	}
+	state_counts[LS_IDLE] = num_lines;
+	return 0;
+}
+
+/*
+ * Pulse dialing
+ *
+ * Each pulse is a break (on hook) followed by a make (off hook), sent as a hook flash at the start of the break.
+ * Pulses are timed by a single thread for all lines, which keeps the pulse trains in a heap ordered by when
+ * the next break is due. Every deadline is computed from the previous deadline, not from when the thread
+ * actually woke up, so timing doesn't drift over a long number, however many lines are dialing at once.
+ *
+ * The flashes still go through the line's action queue, so a flash can only go out on time if nothing else is
+ * queued for the line, and there's a worker free to send it. Rather than let late flashes bunch up and
+ * come out as the wrong digit, a line stops pulse dialing as soon as a break can't start on time.
+ */
+
+#define PULSE_MAX_DIGITS 32
+#define PULSE_MAX_LAG_PCT 10	/* How late a break may start, as a percentage of the pulse period */
+
+static int pulse_pps = 10;				/* Pulses per second */
+static int pulse_break_pct = 60;		/* Percentage of each pulse that is break */
+static int pulse_interdigit_ms = 700;	/* Time between the end of the last break of a digit and the first break of the next */
+
+struct pulse_train {
+	int line;
+	int pulses;					/* Pulses left in the current digit, including the next one */
+	int64_t next;				/* When the next break starts */
+	int64_t sent_for;			/* When the break for the last flash sent was due, 0 if none yet */
+	unsigned int failed:1;		/* The last flash failed or went out late */
+	char digits[PULSE_MAX_DIGITS + 1];	/* Digits left after the current one */
+};
+
+static pthread_mutex_t pulse_lock = PTHREAD_MUTEX_INITIALIZER;	/* Protects all pulse state, including each line's pulse train */
+static pthread_cond_t pulse_cond;
+static struct pulse_train **pulse_heap = NULL;
+static int pulse_count = 0;
+static int pulse_alloc = 0;
+static pthread_t pulse_thread;
+static int pulse_started = 0;
+static int pulse_shutdown = 0;
+
+static int pulse_digit_count(char digit)
+{
+	return digit == '0' ? 10 : digit - '0';
+}
+
+/*! \brief Add a pulse train to the heap. Must be called with pulse_lock held. */
+static int pulse_heap_push(struct pulse_train *train)
+{
+	int i;
+
+	if (pulse_count == pulse_alloc) {
+		int alloc = pulse_alloc ? pulse_alloc * 2 : 64;
+		struct pulse_train **newheap = realloc(pulse_heap, alloc * sizeof(*newheap));
+		if (!newheap) {
+			return -1;
+		}
+		pulse_heap = newheap;
+		pulse_alloc = alloc;
+	}
+	for (i = pulse_count++; i > 0 && pulse_heap[(i - 1) / 2]->next > train->next; i = (i - 1) / 2) {
+		pulse_heap[i] = pulse_heap[(i - 1) / 2];
+	}
+	pulse_heap[i] = train;
+	return 0;
+}
+
+/*! \brief Remove the pulse train that is due first from the heap. Must be called with pulse_lock held. */
+static struct pulse_train *pulse_heap_pop(void)
+{
+	struct pulse_train *first = pulse_heap[0], *last = pulse_heap[--pulse_count];
+	int i = 0;
+
+	for (;;) {
+		int child = 2 * i + 1;
+		if (child >= pulse_count) {
+			break;
+		}
+		if (child + 1 < pulse_count && pulse_heap[child + 1]->next < pulse_heap[child]->next) {
+			child++;
+		}
+		if (last->next <= pulse_heap[child]->next) {
+			break;
+		}
+		pulse_heap[i] = pulse_heap[child];
+		i = child;
+	}
+	pulse_heap[i] = last;
+	return first;
+}
+
+/*! \brief Work out when the next break of a pulse train is due. Returns 0 if there's more to dial, -1 if done. */
+static int pulse_advance(struct pulse_train *train)
+{
+	int64_t period = 1000000000LL / pulse_pps;
+
+	if (--train->pulses > 0) {
+		train->next += period;
+		return 0;
+	} else if (!train->digits[0]) {
+		return -1;
+	}
+	train->next += period * pulse_break_pct / 100 + (int64_t) pulse_interdigit_ms * 1000000LL;
+	train->pulses = pulse_digit_count(train->digits[0]);
+	memmove(train->digits, train->digits + 1, strlen(train->digits));
+	return 0;
+}
+
+static int64_t pulse_max_lag(void)
+{
+	return 1000000000LL / pulse_pps * PULSE_MAX_LAG_PCT / 100;
+}
+
+static int pulse_flash_done(struct ami_session *ami, struct ami_job *job, struct ami_response *resp)
+{
+	struct pulse_train *train;
+	int n = job->line;
+
+	pthread_mutex_lock(&pulse_lock);
+	train = lines[n].pulse;
+	if (!resp || !resp->success) {
+		fprintf(stderr, "Failed to send pulse on line %d\n", n);
+	} else if (job->started - (train ? train->sent_for : job->queued) > pulse_max_lag()) {
+		fprintf(stderr, "Pulse on line %d went out %.1f ms late\n", n, (double) (job->started - (train ? train->sent_for : job->queued)) / 1000000.0);
+	} else {
+		pthread_mutex_unlock(&pulse_lock);
+		return 0;
+	}
+	if (train) {
+		train->failed = 1; /* Stop dialing when the next pulse is due */
+	}
+	pthread_mutex_unlock(&pulse_lock);
+	return -1;
+}
+
+static void *pulse_loop(void *varg)
+{
+	/* Pulses are tens of ms long, so the default 50 us of timer slack would be fine, but there's no need for any */
+	prctl(PR_SET_TIMERSLACK, 1UL, 0UL, 0UL, 0UL);
+
+	pthread_mutex_lock(&pulse_lock);
+	while (!pulse_shutdown) {
+		struct timespec ts;
+		struct pulse_train *train;
+		int64_t lag;
+		int n, busy, res;
+
+		if (!pulse_count) {
+			pthread_cond_wait(&pulse_cond, &pulse_lock);
+			continue;
+		}
+		train = pulse_heap[0];
+		if (monotonic_ns() < train->next) {
+			ts.tv_sec = train->next / 1000000000LL;
+			ts.tv_nsec = train->next % 1000000000LL;
+			pthread_cond_timedwait(&pulse_cond, &pulse_lock, &ts);
+			continue;
+		}
+		pulse_heap_pop();
+		n = train->line;
+		if (!train->sent_for) {
+			train->next = monotonic_ns(); /* The first break is on time whenever it happens, and the rest follow from it */
+		}
+		lag = monotonic_ns() - train->next;
+		res = train->failed;
+		train->sent_for = train->next;
+		pthread_mutex_unlock(&pulse_lock);
+
+		/* The flash can only start on time if the line has nothing else queued (including the previous flash) */
+		pthread_mutex_lock(&pipeline_lock);
+		busy = lines[n].queued;
+		pthread_mutex_unlock(&pipeline_lock);
+		if (res) {
+			/* Already reported */
+		} else if (busy || lag > pulse_max_lag()) {
+			fprintf(stderr, "Pulse on line %d can't go out on time (%s)\n", n, busy ? "other actions are queued for the line" : "running late");
+			res = -1;
+		} else if (!line_active(n, 0)) {
+			res = -1; /* Hung up in the middle of dialing */
+		} else {
+			res = pipeline_submit(n, NULL, pulse_flash_done, "SendFlash", "Channel:%s", lines[n].channel);
+		}
+
+		pthread_mutex_lock(&pulse_lock);
+		if (res || pulse_advance(train) || pulse_heap_push(train)) {
+			if (res) {
+				fprintf(stderr, "Stopped pulse dialing on line %d\n", n);
+			}
+			lines[n].pulse = NULL;
+			free(train);
+		}
+	}
+	pthread_mutex_unlock(&pulse_lock);
+	return NULL;
+}
+
+/*!
+ * \brief Start pulse dialing digits on a line. If the line is already pulse dialing, the digits are dialed afterwards.
+ * \retval 0 if queued, 1 if the line was skipped, -1 on failure
+ */
+static int pulse_dial(int n, const char *digits, int verbose)
+{
+	struct pulse_train *train;
+
+	if (!line_active(n, verbose)) {
+		return 1;
+	}
+
+	pthread_mutex_lock(&pulse_lock);
+	train = lines[n].pulse;
+	if (train) {
+		if (strlen(train->digits) + strlen(digits) > PULSE_MAX_DIGITS) {
+			pthread_mutex_unlock(&pulse_lock);
+			fprintf(stderr, "Too many digits queued on line %d\n", n);
+			return -1;
+		}
+		strcat(train->digits, digits);
+		pthread_mutex_unlock(&pulse_lock);
+		return 0;
+	}
+	if (!pulse_started) {
+		if (pthread_create(&pulse_thread, NULL, pulse_loop, NULL)) {
+			pthread_mutex_unlock(&pulse_lock);
+			fprintf(stderr, "Failed to create pulse dialing thread: %s\n", strerror(errno));
+			return -1;
+		}
+		pulse_started = 1;
+	}
+	train = calloc(1, sizeof(*train));
+	if (!train) {
+		pthread_mutex_unlock(&pulse_lock);
+		return -1;
+	}
+	train->line = n;
+	train->pulses = pulse_digit_count(digits[0]);
+	train->next = monotonic_ns();
+	snprintf(train->digits, sizeof(train->digits), "%s", digits + 1);
+	if (pulse_heap_push(train)) {
+		pthread_mutex_unlock(&pulse_lock);
+		free(train);
+		return -1;
+	}
+	lines[n].pulse = train;
+	pthread_cond_signal(&pulse_cond);
+	pthread_mutex_unlock(&pulse_lock);
+	return 0;
+}
+
+static void pulse_init(void)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&pulse_cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+static void pulse_stop(void)
+{
+	pthread_mutex_lock(&pulse_lock);
+	pulse_shutdown = 1;
+	pthread_cond_broadcast(&pulse_cond);
+	pthread_mutex_unlock(&pulse_lock);
+	if (pulse_started) {
+		pthread_join(pulse_thread, NULL);
+		pulse_started = 0;
+	}
+	while (pulse_count) {
+		struct pulse_train *train = pulse_heap_pop();
+		lines[train->line].pulse = NULL;
+		free(train);
+	}
+	free(pulse_heap);
+	pulse_heap = NULL;
+	pthread_cond_destroy(&pulse_cond);
+}
+
+/*! \brief Decoded commands */
+enum opcode {
+	/* Line commands */
+	OP_ORIGINATE = 0,	/* Go off hook */
+	OP_HANGUP,			/* Go on hook */
+	OP_FLASH,			/* Hook flash */
+	OP_DIAL_DTMF,		/* Dial digits using DTMF */
+	OP_DIAL_PULSE,		/* Dial digits using pulse dialing */
+	OP_ANSWER,			/* Answer incoming call */
+	OP_PLAY,			/* Play audio file */
+	OP_WAIT,			/* Wait for something to happen on a line */
+	/* Global commands */
+	OP_NONE,			/* Empty line (or just an @ offset) */
+	OP_SLEEP,
+	OP_MARK,
+	OP_STATS,
+	OP_HANGUP_ALL,
+	OP_LOAD,
+	OP_HELP,
+	OP_QUIT,
+};
+
+#define NUM_OPCODES (OP_QUIT + 1)
+
+static const char *op_names[NUM_OPCODES] = {
+	[OP_ORIGINATE] = "originate",
+	[OP_HANGUP] = "hangup",
+	[OP_FLASH] = "flash",
+	[OP_DIAL_DTMF] = "dtmf",
+	[OP_DIAL_PULSE] = "pulse",
+	[OP_ANSWER] = "answer",
+	[OP_PLAY] = "play",
+	[OP_WAIT] = "wait",
+	[OP_NONE] = "none",
+	[OP_SLEEP] = "sleep",
+	[OP_MARK] = "mark",
+	[OP_STATS] = "stats",
+	[OP_HANGUP_ALL] = "hangup_all",
+	[OP_LOAD] = "load",
+	[OP_HELP] = "help",
+	[OP_QUIT] = "quit",
+};
+
+static uint64_t commands_executed[NUM_OPCODES];	/* For metrics */
+
+/*!
+ * \brief Queue the action for a line command on a line
+ * \param n Line number
+ * \param op Line command
+ * \param args Arguments to line command
+ * \param batch
+ * \param verbose Whether to explain why a line was skipped
+ * \retval 0 if queued, 1 if the line was skipped, -1 on failure
+ */
+static int queue_line_command(int n, enum opcode op, const char *args, struct ami_batch *batch, int verbose)
+{
+	char buf[192];
+
+	switch (op) {
+		case OP_ORIGINATE:
+			if (lines[n].offhook || lines[n].originating) {
+				if (verbose) {
+					fprintf(stderr, "Line %d is already off hook\n", n);
+				}
+				return 1;
+			}
+			if (async_originate) {
+				/* Mark the line as originating before sending, so an early OriginateResponse will be kept for us */
+				pthread_mutex_lock(&lines_lock);
+				line_set_originating(n, 1);
+				lines[n].actionid = 0;
+				pthread_mutex_unlock(&lines_lock);
+				return pipeline_submit(n, batch, originate_async_done, "Originate", "Channel:%s\r\nContext:%s\r\nExten:%s\r\nPriority:%s\r\nAsync:true", lines[n].dialstr, lines[n].dialcontext, lines[n].dialexten, "1");
+			}
+			return pipeline_submit(n, batch, originate_done, "Originate", "Channel:%s\r\nContext:%s\r\nExten:%s\r\nPriority:%s", lines[n].dialstr, lines[n].dialcontext, lines[n].dialexten, "1");
+		case OP_HANGUP:
+			if (!line_active(n, verbose)) {
+				return 1;
+			}
+			return pipeline_submit(n, batch, hangup_done, "Hangup", "Channel:%s\r\nCause:%d", line_hangup_channel(n, buf, sizeof(buf)), 16);
+		case OP_FLASH:
+			if (!line_active(n, verbose)) {
+				return 1;
+			}
+			return pipeline_submit(n, batch, flash_done, "SendFlash", "Channel:%s", lines[n].channel);
+		case OP_DIAL_DTMF:
+			if (!line_active(n, verbose)) {
+				return 1;
+			}
+			/* The PlayDTMF action is kind of silly. You have to do it once digit at a time.
+			 * However, we don't need to wait for the digits here: queue them all up in the pipeline,
+			 * which will play them in order while we move on to the next command. */
+			for (; *args; args++) {
+				if (pipeline_submit(n, NULL, NULL, "PlayDTMF", "Channel:%s\r\nDigit:%c", lines[n].channel, *args)) {
+					fprintf(stderr, "Failed to queue digit %c on line %d\n", *args, n);
+					return -1;
+				}
+			}
+			return 0;
+		case OP_DIAL_PULSE:
+			return pulse_dial(n, args, verbose);
+		case OP_ANSWER:
+			return line_answer(n, batch, verbose);
+		case OP_PLAY:
+			if (!line_active(n, verbose)) {
+				return 1;
+			}
+			/* Redirect can't set variables, so the file is set first. Since a line's actions are run in order,
+			 * it's set by the time the channel is redirected, without having to wait for it here. */
+			if (pipeline_submit(n, NULL, NULL, "Setvar", "Channel:%s\r\nVariable:PLAYBACK_FILE\r\nValue:%s", lines[n].channel, args)) {
+				return -1;
+			}
+			return pipeline_submit(n, batch, play_done, "Redirect", "Channel:%s\r\nContext:%s\r\nExten:%s\r\nPriority:%s", lines[n].channel, PLAYBACK_DIALPLAN_CONTEXT, lines[n].dialexten, "1");
+		default:
+			return -1;
+	}
+}
+
+/*! \brief Lines selected by a line command, as a list of ranges (so * doesn't need an entry for every line) */
+struct line_selection {
+	struct line_range {
+		int first;
+		int last;
+	} *ranges;
+	int nranges;
+	int alloc;
+	int count;		/* Total number of lines selected */
+};
+
+static int selection_add(struct line_selection *sel, int first, int last)
+{
+	if (sel->nranges == sel->alloc) {
+		int alloc = sel->alloc ? sel->alloc * 2 : 4;
+		struct line_range *newranges = realloc(sel->ranges, alloc * sizeof(*newranges));
+		if (!newranges) {
+			return -1;
+		}
+		sel->ranges = newranges;
+		sel->alloc = alloc;
+	}
+	sel->ranges[sel->nranges].first = first;
+	sel->ranges[sel->nranges].last = last;
+	sel->nranges++;
+	sel->count += last - first + 1;
+	return 0;
+}
+
+/*! \brief Parse a line number at the beginning of a command. Returns the line number, 0 if none, or -1 if invalid */
+static int parse_line_number(char **command)
+{
+	char *end;
+	long n;
+
+	if (!isdigit(**command)) {
+		return 0;
+	}
+	n = strtol(*command, &end, 10);
+	if (n < 1 || n > num_lines) {
+		fprintf(stderr, "Line number must be between 1 and %d\n", num_lines);
+		return -1;
+	}
+	*command = end;
+	return (int) n;
+}
+
+/*! \brief Parse a line number or range of line numbers (e.g. 1-5) and add it to a selection */
+static int parse_line_range(char **command, struct line_selection *sel)
+{
+	int n, last;
+
+	n = parse_line_number(command);
+	if (n <= 0) {
+		if (!n) {
+			fprintf(stderr, "Expected a line number\n");
+		}
+		return -1;
+	}
+	last = n;
+	if (**command == '-') {
+		(*command)++;
+		last = parse_line_number(command);
+		if (last <= 0) {
+			if (!last) {
+				fprintf(stderr, "Invalid line range\n");
+			}
+			return -1;
+		} else if (last < n) {
+			fprintf(stderr, "Invalid line range %d-%d\n", n, last);
+			return -1;
+		}
+	}
+	return selection_add(sel, n, last);
+}
+
+/*!
+ * \brief Parse the lines selected at the beginning of a command
+ * \note Lines can be selected by number (1), range (1-5), all lines (*), or a set of numbers and ranges ({1,3,5-7})
+ * \retval 1 if lines were selected, 0 if this is not a line command, -1 on failure
+ */
+static int parse_selection(char **command, struct line_selection *sel)
+{
+	char *s = *command;
+
+	if (*s == '*') {
+		if (selection_add(sel, 1, num_lines)) {
+			return -1;
+		}
+		*command = s + 1;
+		return 1;
+	} else if (*s == '{') {
+		s++;
+		for (;;) {
+			ltrim(s);
+			if (parse_line_range(&s, sel)) {
+				return -1;
+			}
+			ltrim(s);
+			if (*s == '}') {
+				break;
+			} else if (*s != ',') {
+				fprintf(stderr, "Invalid line set\n");
+				return -1;
+			}
+			s++;
+		}
+		*command = s + 1;
+		return 1;
+	} else if (isdigit(*s)) {
+		if (parse_line_range(&s, sel)) {
+			return -1;
+		}
+		*command = s;
+		return 1;
+	}
+	return 0;
+}
+
+/* How often to check for ^C while waiting for a line command to finish */
+#define LINE_COMMAND_POLL_MS 100
+
+/*! \brief Execute a line command on all selected lines, as one batch */
+static int run_line_command(struct line_selection *sel, enum opcode op, const char *args)
+{
+	struct ami_batch *batch;
+	int i, n, res, single, pending, queued = 0, skipped = 0, ok = 0, failed = 0;
+
+	batch = batch_new();
+	if (!batch) {
+		return 0;
+	}
+
+	/* Queue the action for every line, and then wait for them all to finish.
+	 * Dialed digits aren't part of the batch, since we don't wait for those. */
+	single = sel->count == 1;
+	for (i = 0; i < sel->nranges; i++) {
+		for (n = sel->ranges[i].first; n <= sel->ranges[i].last; n++) {
+			res = queue_line_command(n, op, args, batch, single);
+			if (!res) {
+				queued++;
+			} else if (res > 0) {
+				skipped++;
+			} else {
+				failed++;
+			}
+		}
+	}
+	/* If a server is down, its actions stay queued until it's back, which could be a while, so let ^C interrupt */
+	do {
+		pending = batch_wait_for(batch, LINE_COMMAND_POLL_MS);
+	} while (pending && !got_sigint);
+	pending = batch_release(batch, &ok, &res);
+	failed += res;
+
+	if (pending) {
+		if (single) {
+			fprintf(stderr, "Line %d is still pending\n", sel->ranges[0].first);
+		} else {
+			fprintf(stderr, "%d OK, %d FAILED, %d skipped, %d pending\n", ok, failed, skipped, pending);
+		}
+	} else if (!queued) {
+		if (!single) {
+			fprintf(stderr, "No lines to act on (%d skipped)\n", skipped);
+		}
+	} else if (single) {
+		if (!failed) {
+			fprintf(stderr, "%s\n", op == OP_ORIGINATE && async_originate ? "Queued" : "OK");
+		}
+	} else if (!failed && !skipped) {
+		fprintf(stderr, "%s (%d lines)\n", op == OP_ORIGINATE && async_originate ? "Queued" : "OK", queued);
+	} else {
+		fprintf(stderr, "%d OK, %d FAILED, %d skipped\n", op == OP_DIAL_DTMF || op == OP_DIAL_PULSE ? queued : ok, failed, skipped);
+	}
+	return 0;
+}
+
+/*
+ * Auto-answer
+ *
+ * Inbound calls are queued by the event callback as they start ringing. Since every call rings for the same
+ * amount of time before it's answered, the queue is already in the order they need to be answered in.
+ */
+
+static pthread_t answer_thread;
+static int answer_started = 0;
+
+static void *auto_answer_loop(void *varg)
+{
+	pthread_mutex_lock(&lines_lock);
+	while (!answer_shutdown) {
+		struct timespec ts;
+		int64_t due;
+		int n = answer_head;
+
+		if (!n) {
+			pthread_cond_wait(&answer_cond, &lines_lock);
+			continue;
+		}
+		due = lines[n].ring_start + (int64_t) auto_answer_ms * 1000000LL;
+		if (monotonic_ns() < due) {
+			ts.tv_sec = due / 1000000000LL;
+			ts.tv_nsec = due % 1000000000LL;
+			pthread_cond_timedwait(&answer_cond, &lines_lock, &ts);
+			continue;
+		}
+		answer_head = lines[n].next_answer;
+		if (!answer_head) {
+			answer_tail = 0;
+		}
+		lines[n].answer_queued = 0;
+		pthread_mutex_unlock(&lines_lock);
+		/* If the call stopped ringing in the meantime (or was answered by hand), this just skips it */
+		line_answer(n, NULL, 0);
+		pthread_mutex_lock(&lines_lock);
+	}
+	pthread_mutex_unlock(&lines_lock);
+	return NULL;
+}
+
+static int auto_answer_start(void)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&answer_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (auto_answer_ms < 0) {
+		return 0;
+	}
+	if (pthread_create(&answer_thread, NULL, auto_answer_loop, NULL)) {
+		fprintf(stderr, "Failed to create auto-answer thread: %s\n", strerror(errno));
+		return -1;
+	}
+	answer_started = 1;
+	return 0;
+}
+
+static void auto_answer_stop(void)
+{
+	pthread_mutex_lock(&lines_lock);
+	answer_shutdown = 1;
+	pthread_cond_broadcast(&answer_cond);
+	pthread_mutex_unlock(&lines_lock);
+	if (answer_started) {
+		pthread_join(answer_thread, NULL);
+		answer_started = 0;
+	}
+	pthread_cond_destroy(&answer_cond);
+}
+
+/*
+ * Script timing
+ *
+ * Sleeps are done using a timerfd on the monotonic clock, with absolute deadlines.
+ * When running a script, relative sleeps (s, ms) are measured from the previous deadline,
+ * rather than from whenever the preceding commands happened to finish, so timing doesn't drift.
+ * Commands can also be scheduled at an offset from the start of the script (or the last mark), e.g. @1500ms 3f
+ */
+
+static int interactive = 1;		/* Input is a terminal */
+static int64_t sched_epoch = 0;	/* Time of the first command, or the last mark */
+static int64_t sched_last = 0;	/* Last deadline we waited for */
+static int sched_timerfd = -1;
+
+/*!
+ * \brief Wait until an absolute time (on the monotonic clock)
+ * \param deadline
+ * \param warn_late Whether to warn if the deadline has already passed
+ * \retval 0 on success, -1 if interrupted
+ */
+static int sched_wait_until(int64_t deadline, int warn_late)
+{
+	struct itimerspec its;
+	struct pollfd pfds[2];
+	int64_t now = monotonic_ns();
+
+	sched_last = deadline;
+	if (deadline <= now) {
+		/* Allow a little slack, it's not late if we're only a hair behind */
+		if (warn_late && now - deadline > 1000000LL) {
+			fprintf(stderr, "Running %.1f ms late\n", (double) (now - deadline) / 1000000.0);
+		}
+		return 0;
+	}
+
+	if (sched_timerfd < 0) {
+		sched_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+		if (sched_timerfd < 0) {
+			fprintf(stderr, "timerfd_create failed: %s\n", strerror(errno));
+			return -1;
+		}
+	}
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = deadline / 1000000000LL;
+	its.it_value.tv_nsec = deadline % 1000000000LL;
+	if (timerfd_settime(sched_timerfd, TFD_TIMER_ABSTIME, &its, NULL)) {
+		fprintf(stderr, "timerfd_settime failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	pfds[0].fd = sched_timerfd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = sigint_pipe[0];
+	pfds[1].events = POLLIN;
+	for (;;) {
+		uint64_t expirations;
+		int res = poll(pfds, 2, -1);
+		if (res < 0) {
+			if (errno == EINTR && !got_sigint) {
+				continue;
+			}
+			return -1;
+		}
+		if (pfds[1].revents) {
+			return -1; /* Interrupted, don't read from the pipe, the input loop needs to see it too */
+		}
+		if (pfds[0].revents) {
+			if (read(sched_timerfd, &expirations, sizeof(expirations)) < 0) {
+				/* Shouldn't happen, but either way the timer expired */
+			}
+			return 0;
+		}
+	}
+}
+
+/*!
+ * \brief Parse a duration, e.g. 1500, 1500ms, 1.5s
+ * \param s String to parse. Will be advanced past the duration.
+ * \param unit Nanoseconds per unit, if no unit is specified
+ * \param[out] ns Duration, in nanoseconds
+ * \retval 0 on success, -1 on failure
+ */
+static int parse_duration(char **s, int64_t unit, int64_t *ns)
+{
+	char *start = *s, *end;
+	double value;
+
+	ltrim(start);
+	value = strtod(start, &end);
+	if (end == start || value < 0) {
+		fprintf(stderr, "Invalid time '%s'\n", start);
+		return -1;
+	}
+	if (!strncasecmp(end, "ms", 2)) {
+		unit = 1000000LL;
+		end += 2;
+	} else if (tolower(*end) == 's') {
+		unit = 1000000000LL;
+		end++;
+	}
+	*ns = (int64_t) (value * (double) unit);
+	*s = end;
+	return 0;
+}
+
+/*! \brief Sleep for a duration (in nanoseconds), relative to the previous deadline if running a script */
+static void sched_sleep(int64_t duration)
+{
+	int64_t now = monotonic_ns();
+
+	/* If the previous deadline was a while ago (e.g. an interactive user was typing), just sleep from now */
+	sched_wait_until((interactive || sched_last > now ? now : sched_last) + duration, 0);
+}
+
+/*
+ * Waits
+ *
+ * Rather than sleeping for long enough that something has probably happened (e.g. a call was answered),
+ * a script can wait for it to actually happen, as seen from events, with a timeout in case it never does.
+ */
+
+#define WAIT_DEFAULT_TIMEOUT 30000000000LL	/* 30 seconds */
+#define WAIT_POLL_INTERVAL 100000000LL		/* How often to check for ^C while waiting */
+
+enum wait_type {
+	WAIT_STATE = 0,	/* Line is in a state */
+	WAIT_DTMF,		/* Line received a DTMF digit */
+};
+
+struct wait_cond {
+	enum wait_type type;
+	enum line_state state;
+	char digit;
+	int64_t timeout;
+};
+
+/*! \brief Parse the condition for a wait, e.g. up, ringing 10s, dtmf 5 */
+static int wait_parse_args(char *args, struct wait_cond *wait)
+{
+	char *word;
+	int i;
+
+	memset(wait, 0, sizeof(*wait));
+	wait->timeout = WAIT_DEFAULT_TIMEOUT;
+
+	ltrim(args);
+	word = args;
+	while (isalpha(*args)) {
+		args++;
+	}
+	if (args == word) {
+		fprintf(stderr, "Expected a condition to wait for (idle, dialing, ringing, up, held, conf, or dtmf)\n");
+		return -1;
+	}
+	if (args - word == 4 && !strncasecmp(word, "dtmf", 4)) {
+		wait->type = WAIT_DTMF;
+		ltrim(args);
+		if (!*args || !strchr("0123456789*#ABCDabcd", *args)) {
+			fprintf(stderr, "Expected a DTMF digit to wait for\n");
+			return -1;
+		}
+		wait->digit = (char) toupper(*args++);
+	} else {
+		wait->type = WAIT_STATE;
+		/* Allow abbreviations, e.g. ring */
+		for (i = 0; i < LS_MAX; i++) {
+			size_t len = (size_t) (args - word);
+			if (len >= 2 && len <= strlen(state_names[i]) && !strncasecmp(word, state_names[i], len)) {
+				break;
+			}
+		}
+		if (i == LS_MAX) {
+			fprintf(stderr, "Unknown condition '%.*s'\n", (int) (args - word), word);
+			return -1;
+		}
+		wait->state = i;
+	}
+
+	ltrim(args);
+	if (*args && parse_duration(&args, 1000000000LL, &wait->timeout)) {
+		return -1;
+	}
+	ltrim(args);
+	if (*args) {
+		fprintf(stderr, "Unexpected arguments '%s'\n", args);
+		return -1;
+	}
+	return 0;
+}
+
+/*! \brief Whether a line has met a wait condition. Must be called with lines_lock held. */
+static int wait_cond_met(int n, const struct wait_cond *wait)
+{
+	unsigned int i;
+
+	if (wait->type == WAIT_STATE) {
+		if (wait->state == LS_UP) {
+			/* A call on hold or in a conference is still up */
+			return lines[n].state == LS_UP || lines[n].state == LS_HELD || lines[n].state == LS_CONF;
+		}
+		return lines[n].state == wait->state;
+	}
+
+	/* Digits count if they arrived since the last wait on this line, even if before this one started,
+	 * so a digit sent just before the wait isn't missed. Only the last few digits are kept, though. */
+	i = lines[n].dtmf_waited;
+	if (lines[n].dtmf_received - i > sizeof(lines[n].dtmf_rx)) {
+		i = lines[n].dtmf_received - (unsigned int) sizeof(lines[n].dtmf_rx);
+	}
+	for (; i != lines[n].dtmf_received; i++) {
+		if (toupper(lines[n].dtmf_rx[i % sizeof(lines[n].dtmf_rx)]) == wait->digit) {
+			lines[n].dtmf_waited = i + 1;
+			return 1;
+		}
+	}
+	lines[n].dtmf_waited = i;
+	return 0;
+}
+
+/*! \brief Wait until all the selected lines meet a condition, or the timeout expires */
+static void wait_lines(struct line_selection *sel, const struct wait_cond *wait)
+{
+	unsigned char *met;
+	int64_t start = monotonic_ns(), now = start;
+	int i, k, n, pending = sel->count;
+
+	met = calloc(sel->count, 1);
+	if (!met) {
+		return;
+	}
+
+	pthread_mutex_lock(&lines_lock);
+	line_waiters++;
+	for (;;) {
+		struct timespec ts;
+		int64_t until;
+
+		for (i = 0, k = 0; i < sel->nranges; i++) {
+			for (n = sel->ranges[i].first; n <= sel->ranges[i].last; n++, k++) {
+				if (!met[k] && wait_cond_met(n, wait)) {
+					met[k] = 1;
+					pending--;
+				}
+			}
+		}
+		now = monotonic_ns();
+		if (!pending || now - start >= wait->timeout || got_sigint) {
+			break;
+		}
+		/* Wake up every so often, since ^C doesn't signal the condition */
+		until = now + WAIT_POLL_INTERVAL < start + wait->timeout ? now + WAIT_POLL_INTERVAL : start + wait->timeout;
+		ts.tv_sec = until / 1000000000LL;
+		ts.tv_nsec = until % 1000000000LL;
+		pthread_cond_timedwait(&line_wait_cond, &lines_lock, &ts);
+	}
+	line_waiters--;
+
+	if (pending && sel->count == 1) {
+		n = sel->ranges[0].first;
+		if (wait->type == WAIT_DTMF) {
+			fprintf(stderr, "Timed out waiting for DTMF %c on line %d\n", wait->digit, n);
+		} else {
+			fprintf(stderr, "Timed out waiting for line %d to be %s (it is %s)\n", n, state_names[wait->state], state_names[lines[n].state]);
+		}
+	}
+	pthread_mutex_unlock(&lines_lock);
+	free(met);
+
+	if (got_sigint) {
+		return;
+	} else if (!pending) {
+		if (sel->count == 1) {
+			fprintf(stderr, "OK (%.1f ms)\n", (double) (now - start) / 1000000.0);
+		} else {
+			fprintf(stderr, "OK (%d lines, %.1f ms)\n", sel->count, (double) (now - start) / 1000000.0);
+		}
+	} else if (sel->count > 1) {
+		fprintf(stderr, "Timed out after %.1f s (%d of %d lines)\n", (double) wait->timeout / 1000000000.0, pending, sel->count);
+	}
+	/* Sleeps after this are relative to when the wait finished, not to whatever deadline came before it */
+	sched_last = now;
+}
+
+/*
+ * Load generator
+ *
+ * Originates calls on idle lines at a given rate (calls per second), holds each call
+ * for a while, and then hangs it up. The rate is controlled using a token bucket,
+ * which can be ramped up linearly from 0 to the full rate.
+ * Note that unless originates are async (-a), the pipeline window (-w) bounds how many calls can be
+ * in the process of being set up at once.
+ */
+
+/* Once stopped, how long to wait for async originates to finish before giving up on them */
+#define LOAD_SETUP_TIMEOUT_MS 5000
+
+enum hold_dist {
+	HOLD_FIXED = 0,
+	HOLD_UNIFORM,
+	HOLD_EXPONENTIAL,
+};
+
+struct load_call {
+	int64_t hangup_at;
+	int line;
+};
+
+struct load_gen {
+	/* Settings */
+	double cps;
+	double burst;
+	double ramp;			/* Ramp-up time, in seconds */
+	double duration;		/* How long to generate calls for, in seconds, 0 for forever */
+	double hold_min;		/* Hold time, in seconds */
+	double hold_max;
+	enum hold_dist hold_dist;
+	int max_active;
+	/* Counters */
+	int attempted;
+	int established;
+	int failed;
+	int blocked;			/* Calls not attempted since no line was available */
+	int completed;
+	int setting_up;
+	int active;
+	/* State, protected by load_lock */
+	int stopping;
+	int *free_lines;		/* Stack of idle lines */
+	int nfree;
+	struct load_call *calls;	/* Min-heap of established calls, by hangup time */
+	int ncalls;
+};
+
+static struct load_gen load;
+static pthread_mutex_t load_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t load_cond; /* Uses CLOCK_MONOTONIC */
+
+/* Async originates that have finished, for the load generator to pick up: line number if it succeeded, minus it if not.
+ * This has its own lock, since originates finish with lines_lock held, and the load generator takes lines_lock
+ * while holding load_lock. */
+static pthread_mutex_t load_done_lock = PTHREAD_MUTEX_INITIALIZER;
+static int *load_done = NULL;
+static int load_ndone = 0;
+
+static void load_heap_push(int n, int64_t hangup_at)
+{
+	int i = load.ncalls++;
+
+	/* Sift up. The heap can't overflow, since each line is in it at most once. */
+	while (i > 0 && load.calls[(i - 1) / 2].hangup_at > hangup_at) {
+		load.calls[i] = load.calls[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	load.calls[i].hangup_at = hangup_at;
+	load.calls[i].line = n;
+}
+
+static int load_heap_pop(void)
+{
+	int i = 0, child, n = load.calls[0].line;
+	struct load_call last = load.calls[--load.ncalls];
+
+	/* Sift down */
+	while ((child = 2 * i + 1) < load.ncalls) {
+		if (child + 1 < load.ncalls && load.calls[child + 1].hangup_at < load.calls[child].hangup_at) {
+			child++;
+		}
+		if (last.hangup_at <= load.calls[child].hangup_at) {
+			break;
+		}
+		load.calls[i] = load.calls[child];
+		i = child;
+	}
+	load.calls[i] = last;
+	return n;
+}
+
+static double load_hold_time(void)
+{
+	switch (load.hold_dist) {
+		case HOLD_UNIFORM:
+			return load.hold_min + drand48() * (load.hold_max - load.hold_min);
+		case HOLD_EXPONENTIAL:
+			return -load.hold_min * log(1.0 - drand48());
+		case HOLD_FIXED:
+		default:
+			return load.hold_min;
+	}
+}
+
+/*! \brief Account for a call that finished being set up. Must be called with load_lock held. */
+static void load_call_setup(int n, int offhook)
+{
+	load.setting_up--;
+	if (!offhook) {
+		load.failed++;
+		load.free_lines[load.nfree++] = n;
+	} else {
+		/* If we didn't find out the channel, it's looked for again (or hung up by device) when it's time to hang up */
+		load.established++;
+		load.active++;
+		load_heap_push(n, load.stopping ? 0 : monotonic_ns() + (int64_t) (load_hold_time() * 1000000000.0));
+	}
+}
+
+static int load_originate_done(struct ami_session *ami, struct ami_job *job, struct ami_response *resp)
+{
+	int res, offhook;
+
+	if (job->interrupted) {
+		/* Still setting up, until the resync finds out */
+		originate_interrupted(job->line, 1);
+		return -1;
+	}
+	res = originate_done(ami, job, resp);
+	pthread_mutex_lock(&lines_lock);
+	offhook = lines[job->line].offhook;
+	pthread_mutex_unlock(&lines_lock);
+
+	pthread_mutex_lock(&load_lock);
+	load_call_setup(job->line, offhook);
+	pthread_cond_signal(&load_cond);
+	pthread_mutex_unlock(&load_lock);
+	return res;
+}
+
+/*! \brief Hand a finished async originate to the load generator. Called with lines_lock held. */
+static void load_originate_complete(int n, int success)
+{
+	pthread_mutex_lock(&load_done_lock);
+	load_done[load_ndone++] = success ? n : -n;
+	pthread_mutex_unlock(&load_done_lock);
+	/* Can't take load_lock here, so this wakeup could be missed, but the load generator never sleeps more than 100 ms anyways */
+	pthread_cond_signal(&load_cond);
+}
+
+static int load_hangup_done(struct ami_session *ami, struct ami_job *job, struct ami_response *resp)
+{
+	/* If the hangup failed, the call was probably already hung up by the other end, so the line is free either way */
+	pthread_mutex_lock(&lines_lock);
+	line_set_offhook(job->line, 0);
+	pthread_mutex_unlock(&lines_lock);
+
+	pthread_mutex_lock(&load_lock);
+	load.active--;
+	load.completed++;
+	load.free_lines[load.nfree++] = job->line;
+	pthread_cond_signal(&load_cond);
+	pthread_mutex_unlock(&load_lock);
+	return resp && resp->success ? 0 : -1;
+}
+
+static void load_print_status(int64_t elapsed, double rate, int final)
+{
+	fprintf(stderr, "\r[%7.1fs] %7.1f cps | attempted %d, established %d, failed %d, blocked %d, active %d, completed %d%s",
+		(double) elapsed / 1000000000.0, rate, load.attempted, load.established, load.failed, load.blocked, load.active, load.completed, final ? "\n" : "   ");
+}
+
+/*!
+ * \brief Parse load generator settings
+ * \param args e.g. cps=10 hold=30 max=100 ramp=10 duration=60. Will be modified.
+ * \param[out] settings
+ * \retval 0 on success, -1 if invalid
+ */
+static int load_parse_args(char *args, struct load_gen *settings)
+{
+	char *arg;
+
+	memset(settings, 0, sizeof(*settings));
+	settings->burst = 1;
+	settings->hold_min = settings->hold_max = 30;
+	settings->max_active = num_lines;
+
+	while ((arg = strsep(&args, " \t"))) {
+		char *value;
+		if (!*arg) {
+			continue;
+		}
+		value = strchr(arg, '=');
+		if (!value) {
+			fprintf(stderr, "Expected key=value, got '%s'\n", arg);
+			return -1;
+		}
+		*value++ = '\0';
+		if (!strcasecmp(arg, "cps")) {
+			settings->cps = atof(value);
+		} else if (!strcasecmp(arg, "burst")) {
+			settings->burst = atof(value);
+		} else if (!strcasecmp(arg, "ramp")) {
+			settings->ramp = atof(value);
+		} else if (!strcasecmp(arg, "duration")) {
+			settings->duration = atof(value);
+		} else if (!strcasecmp(arg, "max")) {
+			settings->max_active = atoi(value);
+		} else if (!strcasecmp(arg, "hold")) {
+			char *max = strchr(value, '-');
+			if (*value == '~') {
+				settings->hold_dist = HOLD_EXPONENTIAL;
+				settings->hold_min = settings->hold_max = atof(value + 1);
+			} else if (max) {
+				settings->hold_dist = HOLD_UNIFORM;
+				*max++ = '\0';
+				settings->hold_min = atof(value);
+				settings->hold_max = atof(max);
+			} else {
+				settings->hold_dist = HOLD_FIXED;
+				settings->hold_min = settings->hold_max = atof(value);
+			}
+		} else {
+			fprintf(stderr, "Unknown load setting '%s'\n", arg);
+			return -1;
+		}
+	}
+
+	if (settings->cps <= 0) {
+		fprintf(stderr, "Call rate (cps) must be positive\n");
+		return -1;
+	} else if (settings->burst < 1) {
+		fprintf(stderr, "Burst must be at least 1\n");
+		return -1;
+	} else if (settings->hold_min < 0 || settings->hold_max < settings->hold_min) {
+		fprintf(stderr, "Invalid hold time\n");
+		return -1;
+	} else if (settings->max_active < 1) {
+		fprintf(stderr, "Maximum number of active calls must be positive\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*! \brief Run the load generator until the duration elapses (or we're interrupted) */
+static void load_run(const struct load_gen *settings)
+{
+	pthread_condattr_t attr;
+	int64_t start, now, last, next_status, stop_deadline = 0;
+	double tokens = 0, rate = 0;
+	int n, res;
+
+	load = *settings;
+	load.free_lines = malloc((num_lines + 1) * sizeof(int));
+	load.calls = malloc((num_lines + 1) * sizeof(struct load_call));
+	load_done = malloc((num_lines + 1) * sizeof(int));
+	if (!load.free_lines || !load.calls || !load_done) {
+		free(load.free_lines);
+		free(load.calls);
+		free(load_done);
+		load_done = NULL;
+		return;
+	}
+	/* Push in reverse, so lower numbered lines get used first */
+	for (n = num_lines; n > 0; n--) {
+		if (!lines[n].offhook && !lines[n].originating) {
+			load.free_lines[load.nfree++] = n;
+		}
+	}
+	if (!load.nfree) {
+		fprintf(stderr, "No idle lines available\n");
+		free(load.free_lines);
+		free(load.calls);
+		free(load_done);
+		load_done = NULL;
+		return;
+	}
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&load_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	srand48(time(NULL));
+
+	fprintf(stderr, "Generating load on %d idle line%s (press ^C to stop)\n", load.nfree, ESS(load.nfree));
+	start = last = monotonic_ns();
+	next_status = start + 1000000000LL;
+
+	pthread_mutex_lock(&load_lock);
+	for (;;) {
+		int64_t wake;
+		struct timespec ts;
+
+		now = monotonic_ns();
+		if (!load.stopping && (got_sigint || (load.duration > 0 && now - start >= (int64_t) (load.duration * 1000000000.0)))) {
+			/* Stop making calls, and hang up everything right away */
+			load.stopping = 1;
+			stop_deadline = now + LOAD_SETUP_TIMEOUT_MS * 1000000LL;
+			for (n = 0; n < load.ncalls; n++) {
+				load.calls[n].hangup_at = 0;
+			}
+		}
+		if (load.stopping && load.setting_up && now >= stop_deadline) {
+			/* An OriginateResponse may never come (e.g. it was lost during a reconnect), so stop waiting for them.
+			 * If one does come in later, it's handled like any other originate. */
+			int abandoned = 0;
+			pthread_mutex_lock(&lines_lock);
+			for (n = 1; n <= num_lines; n++) {
+				if (lines[n].load_call) {
+					lines[n].load_call = 0;
+					abandoned++;
+				}
+			}
+			pthread_mutex_unlock(&lines_lock);
+			if (abandoned) {
+				fprintf(stderr, "\nGave up waiting for %d call%s to be set up\n", abandoned, ESS(abandoned));
+				load.setting_up -= abandoned;
+				load.failed += abandoned;
+			}
+		}
+		/* Pick up async originates that finished */
+		pthread_mutex_lock(&load_done_lock);
+		while (load_ndone) {
+			n = load_done[--load_ndone];
+			load_call_setup(n < 0 ? -n : n, n > 0);
+		}
+		pthread_mutex_unlock(&load_done_lock);
+
+		if (load.stopping && !load.active && !load.setting_up) {
+			break;
+		}
+
+		/* Hang up calls that have been held long enough */
+		while (load.ncalls && load.calls[0].hangup_at <= now) {
+			char buf[192];
+			n = load_heap_pop();
+			pipeline_submit(n, NULL, load_hangup_done, "Hangup", "Channel:%s\r\nCause:%d", line_hangup_channel(n, buf, sizeof(buf)), 16);
+		}
+
+		/* Refill the token bucket, at the current (possibly ramping) rate */
+		rate = load.ramp > 0 && now - start < (int64_t) (load.ramp * 1000000000.0) ? load.cps * (double) (now - start) / (load.ramp * 1000000000.0) : load.cps;
+		tokens += rate * (double) (now - last) / 1000000000.0;
+		if (tokens > load.burst) {
+			tokens = load.burst;
+		}
+		last = now;
+
+		/* Originate as many calls as we have tokens for */
+		while (!load.stopping && tokens >= 1) {
+			tokens -= 1;
+			if (!load.nfree || load.active + load.setting_up >= load.max_active) {
+				load.blocked++;
+				continue;
+			}
+			load.attempted++;
+			n = load.free_lines[--load.nfree];
+			load.setting_up++;
+			if (async_originate) {
+				/* The call is set up when the OriginateResponse comes in, so the worker is free for the next one right away */
+				pthread_mutex_lock(&lines_lock);
+				line_set_originating(n, 1);
+				lines[n].actionid = 0;
+				lines[n].load_call = 1;
+				pthread_mutex_unlock(&lines_lock);
+				res = pipeline_submit(n, NULL, originate_async_done, "Originate", "Channel:%s\r\nContext:%s\r\nExten:%s\r\nPriority:%s\r\nAsync:true", lines[n].dialstr, lines[n].dialcontext, lines[n].dialexten, "1");
+				if (res) {
+					pthread_mutex_lock(&lines_lock);
+					line_set_originating(n, 0);
+					lines[n].load_call = 0;
+					pthread_mutex_unlock(&lines_lock);
+				}
+			} else {
+				res = pipeline_submit(n, NULL, load_originate_done, "Originate", "Channel:%s\r\nContext:%s\r\nExten:%s\r\nPriority:%s", lines[n].dialstr, lines[n].dialcontext, lines[n].dialexten, "1");
+			}
+			if (res) {
+				load.setting_up--;
+				load.failed++;
+				load.free_lines[load.nfree++] = n;
+			}
+		}
+
+		if (now >= next_status) {
+			load_print_status(now - start, rate, 0);
+			next_status += 1000000000LL;
+		}
+
+		/* Sleep until the next token, hangup, or status update, whichever is first.
+		 * Wake up at least every 100 ms, so we notice if we're interrupted. */
+		wake = next_status;
+		if (now + 100000000LL < wake) {
+			wake = now + 100000000LL;
+		}
+		if (load.ncalls && load.calls[0].hangup_at < wake) {
+			wake = load.calls[0].hangup_at;
+		}
+		if (!load.stopping && rate > 0) {
+			int64_t next_token = now + (int64_t) ((1 - tokens) / rate * 1000000000.0);
+			if (next_token < wake) {
+				wake = next_token;
+			}
+		}
+		ts.tv_sec = wake / 1000000000LL;
+		ts.tv_nsec = wake % 1000000000LL;
+		pthread_cond_timedwait(&load_cond, &load_lock, &ts);
+	}
+	load_print_status(monotonic_ns() - start, rate, 1);
+	pthread_mutex_unlock(&load_lock);
+
+	pthread_cond_destroy(&load_cond);
+	free(load.free_lines);
+	free(load.calls);
+	free(load_done);
+	load_done = NULL;
+	/* Sleeps after this are relative to when the load run finished */
+	sched_last = monotonic_ns();
+}
+
+static void show_command_help(void)
+{
+	printf(
+		"\r"
+		"Usage: [<lines>] command [arguments]\n"
+		"Lines may be a line number (1), a range (1-5), all lines (*), or a set ({1,3,5-7})\n"
+		"-- Line Actions --\n"
+		"o     - Go off hook\n"
+		"dt    - Dial digits using DTMF\n"
+		"dp    - Dial digits using pulse dialing\n"
+		"a     - Answer incoming call\n"
+		"f     - Hook flash\n"
+		"w     - Wait for a line to be idle, dialing, ringing, up, held, or in a conf, or to receive a DTMF digit,\n"
+		"        with an optional timeout (default 30 s)\n"
+		"h     - Go on hook\n"
+		"p     - Play audio file\n"
+		"-- General Actions --\n"
+		"k     - hang up all active lines\n"
+		"stats - show AMI action latency statistics\n"
+		"load  - generate load, e.g. load cps=10 hold=30 max=100 ramp=10 duration=60\n"
+		"s     - sleep for N seconds\n"
+		"ms    - sleep for N milliseconds\n"
+		"@     - run a command at a time offset from the start of the script (or mark)\n"
+		"mark  - reset the start time used for @\n"
+		"q     - Quit\n"
+		"-- Examples --\n"
+		"1o             ; originate on line 1\n"
+		"2 o            ; originate on line 2 (whitespace is ignored)\n"
+		"1-5o           ; originate on lines 1 through 5\n"
+		"{2,4}f         ; hook flash on lines 2 and 4\n"
+		"*h             ; hang up all lines that are off hook\n"
+		"1dt47          ; dial DTMF 47 on line 1\n"
+		"3a             ; answer incoming call on line 3\n"
+		"3w ringing 10s ; wait up to 10 seconds for line 3 to ring\n"
+		"1-5w up        ; wait for lines 1 through 5 to be answered\n"
+		"1w dtmf 5      ; wait for line 1 to receive DTMF 5\n"
+		"1p custom/beep ; Play audio file on line\n"
+		"ms750          ; sleep for 750ms\n"
+		"@1500ms 3f     ; hook flash on line 3, 1.5 seconds after the start\n"
+	);
+}
+
+/*! \brief A parsed command, ready to execute */
+struct command {
+	enum opcode op;
+	int64_t at;						/* Offset from the start (or mark) to wait for before executing, or -1 to execute right away */
+	int64_t duration;				/* Sleep duration, in nanoseconds */
+	struct line_selection sel;		/* Lines to act on, for line commands */
+	const char *args;				/* Arguments (e.g. digits to dial), pointing into the command string */
+	struct wait_cond wait;			/* Condition to wait for, for waits */
+	struct load_gen *load_settings;
+};
+
+static void command_free(struct command *cmd)
+{
+	free(cmd->sel.ranges);
+	free(cmd->load_settings);
+}
+
+/*!
+ * \brief Parse a command, without executing it
+ * \param command Command string. Will be modified, and the parsed command may point into it, so it must outlive the parsed command.
+ * \param[out] cmd
+ * \retval 0 on success, -1 if the command is invalid
+ */
+static int parse_command(char *command, struct command *cmd)
+{
+	char *tmp;
+	int res;
+
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->op = OP_NONE;
+	cmd->at = -1;
+
+	tmp = strchr(command, ';'); /* Ignore comments. Use ; instead of # since # is a DTMF digit. */
+	if (tmp) {
+		*tmp = '\0';
+	}
+	command = trim(command);
+
+	if (*command == '@') {
+		/* Wait until a given offset from the start before executing the command */
+		command++;
+		if (parse_duration(&command, 1000000LL, &cmd->at)) {
+			return -1;
+		}
+		ltrim(command);
+	}
+
+	/* Get line number(s), if applicable. */
+	res = parse_selection(&command, &cmd->sel);
+	if (res < 0) {
+		return -1;
+	}
+	ltrim(command);
+
+	if (res) { /* Line command */
+		switch (tolower(*command++)) {
+			case 'o':
+				cmd->op = OP_ORIGINATE;
+				break;
+			case 'h':
+				cmd->op = OP_HANGUP;
+				break;
+			case 'f':
+				cmd->op = OP_FLASH;
+				break;
+			case 'a':
+				cmd->op = OP_ANSWER;
+				break;
+			case 'p':
+				cmd->op = OP_PLAY;
+				command = trim(command);
+				if (!*command) {
+					fprintf(stderr, "No file to play\n");
+					return -1;
+				} else if (strlen(command) > PLAYBACK_MAX_FILE) {
+					fprintf(stderr, "File name is too long\n");
+					return -1;
+				}
+				cmd->args = command;
+				return 0;
+			case 'd': /* dial */
+				switch (tolower(*command++)) {
+					case 't':
+						cmd->op = OP_DIAL_DTMF;
+						break;
+					case 'p':
+						cmd->op = OP_DIAL_PULSE;
+						break;
+					default:
+						fprintf(stderr, "Invalid dial type %c\n", *(command - 1));
+						return -1;
+				}
+				ltrim(command);
+				if (!*command) {
+					fprintf(stderr, "No digits to dial\n");
+					return -1;
+				} else if (command[strspn(command, cmd->op == OP_DIAL_PULSE ? "0123456789" : "0123456789*#ABCDabcd")]) {
+					fprintf(stderr, "Invalid digits '%s'\n", command);
+					return -1;
+				} else if (cmd->op == OP_DIAL_PULSE && strlen(command) > PULSE_MAX_DIGITS) {
+					fprintf(stderr, "Can't pulse dial more than %d digits at once\n", PULSE_MAX_DIGITS);
+					return -1;
+				}
+				cmd->args = command;
+				return 0;
+			case 'w':
+				cmd->op = OP_WAIT;
+				return wait_parse_args(command, &cmd->wait);
+			default:
+				fprintf(stderr, "Unknown line command '%c'\n", *(command - 1));
+				return -1;
+		}
+		ltrim(command);
+		if (*command) {
+			fprintf(stderr, "Unexpected arguments '%s'\n", command);
+			return -1;
+		}
+		return 0;
+	}
+
+	/* Global command */
+	if (!*command) {
+		return 0; /* Empty line */
+	} else if (*command == 's' && (!command[1] || isspace(command[1]) || isdigit(command[1]))) {
+		command++;
+		cmd->op = OP_SLEEP;
+		if (parse_duration(&command, 1000000000LL, &cmd->duration)) {
+			return -1;
+		}
+	} else if (!strncasecmp(command, "ms", 2)) {
+		command += 2;
+		cmd->op = OP_SLEEP;
+		if (parse_duration(&command, 1000000LL, &cmd->duration)) {
+			return -1;
+		}
+	} else if (!strcasecmp(command, "stats")) {
+		cmd->op = OP_STATS;
+		return 0;
+	} else if (!strcasecmp(command, "mark")) {
+		cmd->op = OP_MARK;
+		return 0;
+	} else if (!strcasecmp(command, "q")) {
+		cmd->op = OP_QUIT;
+		return 0;
+	} else if (!strcasecmp(command, "k")) {
+		cmd->op = OP_HANGUP_ALL;
+		return 0;
+	} else if (!strcmp(command, "?")) {
+		cmd->op = OP_HELP;
+		return 0;
+	} else if (!strncasecmp(command, "load", 4) && (!command[4] || isspace(command[4]))) {
+		cmd->op = OP_LOAD;
+		cmd->load_settings = malloc(sizeof(*cmd->load_settings));
+		if (!cmd->load_settings || load_parse_args(command + 4, cmd->load_settings)) {
+			return -1;
+		}
+		return 0;
+	} else {
+		fprintf(stderr, "Unknown global command '%s'\n", command);
+		return -1;
+	}
+
+	/* Sleep */
+	ltrim(command);
+	if (*command) {
+		fprintf(stderr, "Unexpected arguments '%s'\n", command);
+		return -1;
+	}
+	return 0;
+}
+
+/*! \brief Execute a parsed command. Returns -1 if we should stop. */
+static int execute_command(struct command *cmd)
+{
+	if (!sched_epoch) {
+		/* The first command starts the clock for @ offsets */
+		sched_epoch = sched_last = monotonic_ns();
+	}
+	if (cmd->at >= 0) {
+		sched_wait_until(sched_epoch + cmd->at, 1);
+	}
+
+	__atomic_fetch_add(&commands_executed[cmd->op], 1, __ATOMIC_RELAXED);
+	switch (cmd->op) {
+		case OP_ORIGINATE:
+		case OP_HANGUP:
+		case OP_FLASH:
+		case OP_DIAL_DTMF:
+		case OP_DIAL_PULSE:
+		case OP_ANSWER:
+		case OP_PLAY:
+			run_line_command(&cmd->sel, cmd->op, cmd->args);
+			break;
+		case OP_WAIT:
+			wait_lines(&cmd->sel, &cmd->wait);
+			break;
+		case OP_NONE:
+			break;
+		case OP_SLEEP:
+			sched_sleep(cmd->duration);
+			break;
+		case OP_MARK:
+			sched_epoch = sched_last = monotonic_ns();
+			break;
+		case OP_STATS:
+			stats_dump();
+			break;
+		case OP_HANGUP_ALL:
+			hangup_all();
+			break;
+		case OP_LOAD:
+			load_run(cmd->load_settings);
+			break;
+		case OP_HELP:
+			show_command_help();
+			break;
+		case OP_QUIT:
+			return -1;
+	}
+	return 0;
+}
+
+/*! \brief Parse and execute a command. Returns -1 if we should stop. */
+static int run_command(char *command)
+{
+	struct command cmd;
+	int res = 0;
+
+	if (!parse_command(command, &cmd)) {
+		res = execute_command(&cmd);
+	}
+	command_free(&cmd);
+	return res;
+}
+
+/*! \brief Read and execute commands typed at a terminal, one character at a time */
+static void run_interactive(void)
+{
+	struct pollfd pfds[2];
+	char *pos;
+	int left, reset, res;
+
+	/* Wait for input. */
+	pfds[0].fd = STDIN_FILENO;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = sigint_pipe[0];
+	pfds[1].events = POLLIN;
+
+	reset = 1;
+
+	for (;;) {
+		if (got_sigint) {
+			break;
+		}
+		if (reset) {
+			pos = inputbuf;
+			left = sizeof(inputbuf) - 1;
+			reset = 0;
+			fprintf(stderr, ">");
+		}
+		/* This thread will block forever on input. */
+		res = poll(pfds, 2, -1);
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		} else if (pfds[0].revents) {
+			/* Got some input. */
+			char c;
+			int num_read = read(STDIN_FILENO, &c, 1); /* Only read one char. */
+			if (num_read < 1) {
+				break; /* Disconnect */
+			}
+			/*! \todo Might be nice to add command history (using histedit) */
+			if (c == '\n') {
+				/* Got a full command, execute */
+				*pos = '\0';
+				if (run_command(inputbuf)) {
+					break;
+				}
+				inputbuf[0] = '\0';
+				reset = 1;
+			} else if (c == '?') {
+				show_command_help();
+				printf("\n");
+				reset = 1;
+			} else {
+				*pos++ = c;
+				if (--left <= 1) {
+					fprintf(stderr, "Command too long\n");
+					reset = 1;
+				}
+			}
+		}
+	}
+}
+
+/*! \brief Execute one line of a script. Returns -1 if we should stop. */
+static int run_script_line(char *line, char *end)
+{
+	if (got_sigint) {
+		return -1;
+	}
+	/* Tolerate CR LF line endings */
+	if (end > line && *(end - 1) == '\r') {
+		*(end - 1) = '\0';
+	}
+	fprintf(stderr, ">");
+	return run_command(line);
+}
+
+/*! \brief Execute every complete line in a buffer, in place. Returns -1 if we should stop. */
+static int run_script_lines(char *buf, size_t len, size_t *consumed)
+{
+	char *start = buf, *end = buf + len, *nl;
+
+	while ((nl = memchr(start, '\n', end - start))) {
+		*nl = '\0';
+		if (run_script_line(start, nl)) {
+			return -1;
+		}
+		start = nl + 1;
+	}
+	*consumed = start - buf;
+	return 0;
+}
+
+#define INPUT_CHUNK_SIZE 65536
+
+/*! \brief Read and execute commands from a pipe or redirected file, a chunk at a time */
+static void run_stream(int fd)
+{
+	char *buf;
+	size_t len = 0, consumed;
+	int discarding = 0; /* Dropping the rest of a line that was too long */
+
+	buf = malloc(INPUT_CHUNK_SIZE);
+	if (!buf) {
+		return;
+	}
+
+	for (;;) {
+		ssize_t res = read(fd, buf + len, INPUT_CHUNK_SIZE - len - 1);
+		if (res < 0) {
+			if (errno == EINTR && !got_sigint) {
+				continue;
+			}
+			break;
+		} else if (!res) {
+			/* End of input. Execute the last line, if it didn't end in a newline. */
+			if (len && !discarding) {
+				buf[len] = '\0';
+				run_script_line(buf, buf + len);
+			}
+			break;
+		}
+		len += res;
+		if (discarding) {
+			char *eol = memchr(buf, '\n', len);
+			if (!eol) {
+				len = 0;
+				continue;
+			}
+			discarding = 0;
+			len -= eol + 1 - buf;
+			memmove(buf, eol + 1, len);
+		}
+		if (run_script_lines(buf, len, &consumed)) {
+			break;
+		}
+		/* Keep any partial line for next time */
+		len -= consumed;
+		memmove(buf, buf + consumed, len);
+		if (len == INPUT_CHUNK_SIZE - 1) {
+			/* Don't execute the rest of it as if it were a command of its own */
+			fprintf(stderr, "Command too long\n");
+			discarding = 1;
+			len = 0;
+		}
+	}
+
+	free(buf);
+}
+
+/*!
+ * \brief A script file, parsed ahead of time
+ * \note The file is memory mapped, and the parsed commands point into the mapping, so it stays mapped until the script is freed
+ */
+struct script {
+	char *map;
+	size_t size;
+	char *last;					/* Copy of the last line, if it doesn't end in a newline */
+	struct command *commands;
+	int count;
+	int alloc;
+};
+
+static void script_free(struct script *script)
+{
+	int i;
+
+	for (i = 0; i < script->count; i++) {
+		command_free(&script->commands[i]);
+	}
+	free(script->commands);
+	free(script->last);
+	if (script->map) {
+		munmap(script->map, script->size);
+	}
+	free(script);
+}
+
+/*! \brief Parse one line of a script and add it to the script. Returns -1 if the line is invalid. */
+static int script_add_line(struct script *script, const char *filename, int lineno, char *line, char *end)
+{
+	struct command *cmd;
+
+	/* Tolerate CR LF line endings */
+	if (end > line && *(end - 1) == '\r') {
+		*(end - 1) = '\0';
+	}
+	if (script->count == script->alloc) {
+		int alloc = script->alloc ? script->alloc * 2 : 64;
+		struct command *newcommands = realloc(script->commands, alloc * sizeof(*newcommands));
+		if (!newcommands) {
+			return -1;
+		}
+		script->commands = newcommands;
+		script->alloc = alloc;
+	}
+	cmd = &script->commands[script->count];
+	if (parse_command(line, cmd)) {
+		command_free(cmd);
+		fprintf(stderr, "%s:%d: Invalid command\n", filename, lineno);
+		return -1;
+	}
+	if (cmd->op == OP_NONE && cmd->at < 0) {
+		return 0; /* Blank line or comment, nothing to do */
+	}
+	script->count++;
+	return 0;
+}
+
+/*!
+ * \brief Parse an entire script file up front, so that any errors are caught before we do anything
+ * \note Requires the number of lines to be known, to validate line selections
+ * \return Parsed script, or NULL on failure
+ */
+static struct script *script_compile(const char *filename)
+{
+	struct script *script;
+	struct stat st;
+	char *start, *end, *nl;
+	int fd, lineno = 0, errors = 0;
+
+	script = calloc(1, sizeof(*script));
+	if (!script) {
+		return NULL;
+	}
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open %s: %s\n", filename, strerror(errno));
+		free(script);
+		return NULL;
+	}
+	if (fstat(fd, &st)) {
+		fprintf(stderr, "Failed to stat %s: %s\n", filename, strerror(errno));
+		close(fd);
+		free(script);
+		return NULL;
+	}
+	if (!st.st_size) {
+		close(fd);
+		return script;
+	}
+
+	/* Private mapping, so we can terminate lines in place without modifying the file */
+	script->size = st.st_size;
+	script->map = mmap(NULL, script->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (script->map == MAP_FAILED) {
+		fprintf(stderr, "Failed to map %s: %s\n", filename, strerror(errno));
+		script->map = NULL;
+		script_free(script);
+		return NULL;
+	}
+	madvise(script->map, script->size, MADV_SEQUENTIAL);
+
+	start = script->map;
+	end = script->map + script->size;
+	while ((nl = memchr(start, '\n', end - start))) {
+		*nl = '\0';
+		if (script_add_line(script, filename, ++lineno, start, nl)) {
+			errors++;
+		}
+		start = nl + 1;
+	}
+	if (start < end) {
+		/* The last line doesn't end in a newline, and there may not be room to terminate it in the mapping */
+		script->last = strndup(start, end - start);
+		if (!script->last || script_add_line(script, filename, ++lineno, script->last, script->last + strlen(script->last))) {
+			errors++;
+		}
+	}
+
+	if (errors) {
+		fprintf(stderr, "%d error%s in %s\n", errors, ESS(errors), filename);
+		script_free(script);
+		return NULL;
+	}
+	return script;
+}
+
+/*! \brief Execute a parsed script */
+static void script_run(struct script *script)
+{
+	int i;
+
+	for (i = 0; i < script->count; i++) {
+		if (got_sigint) {
+			break;
+		}
+		fprintf(stderr, ">");
+		if (execute_command(&script->commands[i])) {
+			break;
+		}
+	}
+}
+
+/*! \brief Whether a host is this machine, i.e. localhost or a loopback address */
+static int host_is_loopback(const char *host)
+{
+	struct in_addr addr4;
+	struct in6_addr addr6;
+
+	if (!strcasecmp(host, "localhost")) {
+		return 1;
+	} else if (inet_pton(AF_INET, host, &addr4) == 1) {
+		return (ntohl(addr4.s_addr) >> 24) == 127;
+	} else if (inet_pton(AF_INET6, host, &addr6) == 1) {
+		return IN6_IS_ADDR_LOOPBACK(&addr6) || (IN6_IS_ADDR_V4MAPPED(&addr6) && addr6.s6_addr[12] == 127);
+	}
+	return 0;
+}
+
+/*!
+ * \brief Add a server to connect to
+ * \param spec [name=]host[:port][/first-last], e.g. a=10.1.1.1:5038/1-50
+ * \note Lines are bound to servers later, once we know how many lines there are
+ */
+static int session_add(const char *spec)
+{
+	struct session *session;
+	char buf[256];
+	char *host, *name, *tmp;
+
+	if (num_sessions >= MAX_SESSIONS) {
+		fprintf(stderr, "Too many servers (maximum is %d)\n", MAX_SESSIONS);
+		return -1;
+	}
+	session = &sessions[num_sessions];
+	memset(session, 0, sizeof(*session));
+
+	snprintf(buf, sizeof(buf), "%s", spec);
+	host = strchr(buf, '=');
+	if (host) {
+		*host++ = '\0';
+		name = buf;
+	} else {
+		host = name = buf;
+	}
+	tmp = strchr(host, '/');
+	if (tmp) {
+		*tmp++ = '\0';
+		if (sscanf(tmp, "%d-%d", &session->first_line, &session->last_line) != 2 || session->first_line < 1 || session->last_line < session->first_line) {
+			fprintf(stderr, "Invalid line range '%s' for server %s\n", tmp, host);
+			return -1;
+		}
+	}
+	if (*host == '[' && (tmp = strchr(host, ']'))) {
+		/* IPv6 address, with a port, e.g. [::1]:5038 */
+		*tmp++ = '\0';
+		if (*tmp == ':') {
+			session->port = atoi(tmp + 1);
+		}
+		if (name == host) {
+			name++;
+		}
+		host++;
+	} else if ((tmp = strchr(host, ':')) && !strchr(tmp + 1, ':')) {
+		/* If there's more than one colon, it's an IPv6 address without a port */
+		*tmp++ = '\0';
+		session->port = atoi(tmp);
+	}
+	if (!*host) {
+		fprintf(stderr, "No hostname in '%s'\n", spec);
+		return -1;
+	} else if (strlen(host) >= sizeof(session->host) || strlen(name) >= sizeof(session->name)) {
+		fprintf(stderr, "Server name too long: '%s'\n", spec);
+		return -1;
+	}
+	strcpy(session->host, host);
+	strcpy(session->name, name); /* If no name was given, this is the hostname */
+
+	pthread_mutex_init(&session->chan_index_lock, NULL);
+	num_sessions++;
+	return 0;
+}
+
+/*!
+ * \brief Bind every line to a server
+ * \note If no servers were given line ranges, the lines are divided evenly between them, in order.
+ *       Otherwise, every server must have a range, and every line must be in exactly one range.
+ */
+static int sessions_assign_lines(void)
+{
+	int i, j, n, explicit = 0;
+
+	for (i = 0; i < num_sessions; i++) {
+		struct session *session = &sessions[i];
+		if (session->first_line) {
+			explicit++;
+		}
+		session->nconns = connections_per_session;
+		session->conns = calloc(session->nconns, sizeof(*session->conns));
+		if (!session->conns) {
+			return -1;
+		}
+		for (j = 0; j < session->nconns; j++) {
+			session->conns[j].session = session;
+			session->conns[j].index = j;
+			pthread_cond_init(&session->conns[j].pipeline_cond, NULL);
+		}
+	}
+
+	if (!explicit) {
+		int first = 1;
+		for (i = 0; i < num_sessions; i++) {
+			int count = num_lines / num_sessions + (i < num_lines % num_sessions);
+			if (!count) {
+				fprintf(stderr, "Not enough lines for %d servers\n", num_sessions);
+				return -1;
+			}
+			sessions[i].first_line = first;
+			sessions[i].last_line = first + count - 1;
+			first += count;
+		}
+	} else if (explicit != num_sessions) {
+		fprintf(stderr, "If any server is given a line range, all of them must be\n");
+		return -1;
+	}
+
+	for (i = 0; i < num_sessions; i++) {
+		struct session *session = &sessions[i];
+		if (session->last_line > num_lines) {
+			fprintf(stderr, "Lines %d-%d for server %s are out of range (there are %d lines)\n", session->first_line, session->last_line, session->name, num_lines);
+			return -1;
+		}
+		for (n = session->first_line; n <= session->last_line; n++) {
+			if (lines[n].session) {
+				fprintf(stderr, "Line %d is assigned to both %s and %s\n", n, lines[n].session->name, session->name);
+				return -1;
+			}
+			lines[n].session = session;
+			/* Interleave the lines across the connections, so that a range of lines uses all of them */
+			lines[n].conn = &session->conns[(n - session->first_line) % session->nconns];
+		}
+	}
+	for (n = 1; n <= num_lines; n++) {
+		if (!lines[n].session) {
+			fprintf(stderr, "Line %d is not assigned to any server\n", n);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+#define MAX_EVENT_FILTERS 8
+
+/*!
+ * \brief Ask the server to only send events for our lines' channels, so we (and CAMI) don't have to wade through all of them
+ * \note Asterisk only sends events that match at least one of the filters (regular expressions matched against the whole event)
+ */
+static void conn_install_filters(struct ami_conn *conn)
+{
+	struct session *session = conn->session;
+	struct ami_response *resp;
+	char prefixes[MAX_EVENT_FILTERS][64];
+	int i, n, nprefixes = 0, failed = 0;
+
+	/* The devices of most lines only differ by a number at the end, so one filter usually covers them all */
+	for (n = session->first_line; n <= session->last_line; n++) {
+		char prefix[64];
+		size_t len = strlen(lines[n].devicename);
+		while (len && isdigit(lines[n].devicename[len - 1])) {
+			len--;
+		}
+		memcpy(prefix, lines[n].devicename, len);
+		prefix[len] = '\0';
+		for (i = 0; i < nprefixes; i++) {
+			if (!strcmp(prefixes[i], prefix)) {
+				break;
+			}
+		}
+		if (i < nprefixes) {
+			continue;
+		} else if (nprefixes == MAX_EVENT_FILTERS) {
+			nprefixes = 0; /* Too many different devices to filter efficiently, just take everything */
+			break;
+		}
+		strcpy(prefixes[nprefixes++], prefix);
+	}
+
+	/* Only the classes of events we use: Newchannel, Newstate, Hangup, Dial*, Bridge*, Hold, OriginateResponse, and DTMF */
+	resp = ami_action(conn->ami, "Events", "EventMask:%s", "call,dtmf");
+	failed |= !resp || !resp->success;
+	if (resp) {
+		ami_resp_free(resp);
+	}
+
+	for (i = 0; i < nprefixes; i++) {
+		char regex[160];
+		regex_escape(regex, sizeof(regex), prefixes[i]);
+		/* Matches Channel, DestChannel, etc. */
+		resp = ami_action(conn->ami, "Filter", "Operation:Add\r\nFilter:Channel: %s", regex);
+		failed |= !resp || !resp->success;
+		if (resp) {
+			ami_resp_free(resp);
+		}
+	}
+	if (nprefixes) {
+		/* If an originate fails, the channel is the dial string rather than the device */
+		resp = ami_action(conn->ami, "Filter", "Operation:Add\r\nFilter:%s", "Event: OriginateResponse");
+		failed |= !resp || !resp->success;
+		if (resp) {
+			ami_resp_free(resp);
+		}
+		/* Other channels joining a line's bridge are how we see it become a conference */
+		resp = ami_action(conn->ami, "Filter", "Operation:Add\r\nFilter:%s", "Event: Bridge(Enter|Leave)");
+		failed |= !resp || !resp->success;
+		if (resp) {
+			ami_resp_free(resp);
+		}
+	}
+
+	if (failed) {
+		fprintf(stderr, "Failed to set up event filtering on %s (does the user have the system permission?)\n", session->name);
+	}
+}
+
+/*!
+ * \brief Connect and log in on one connection to a server
+ * \param conn
+ * \param quiet Whether to suppress failure messages (e.g. when retrying)
+ * \retval 0 on success, -1 on failure
+ */
+static int conn_connect(struct ami_conn *conn, int quiet)
+{
+	struct session *session = conn->session;
+	struct ami_session *ami;
+	int64_t start;
+	int res;
+
+	ami = ami_connect(session->host, session->port, ami_callback, disconnect_callback);
+	if (!ami) {
+		if (!quiet) {
+			fprintf(stderr, "Failed to connect to AMI (host: %s, user: %s)\n", session->host, ami_username);
+		}
+		return -1;
+	}
+	conn->ami = ami;
+	start = monotonic_ns();
+	res = ami_action_login(ami, ami_username, ami_password);
+	stats_record(STAT_LOGIN, monotonic_ns() - start, !res);
+	if (res) {
+		if (!quiet) {
+			fprintf(stderr, "Failed to log in to %s with username %s\n", session->name, ami_username);
+		}
+		conn->ami = NULL;
+		ami_disconnect(ami);
+		ami_destroy(ami);
+		return -1;
+	}
+	if (ami_debug_level) {
+		ami_set_debug(ami, STDERR_FILENO);
+		ami_set_debug_level(ami, ami_debug_level);
+	}
+	if (conn->index) {
+		/* We only handle events on the first connection, so don't make the server send them on the others */
+		struct ami_response *resp = ami_action(ami, "Events", "EventMask:%s", "off");
+		if (resp) {
+			ami_resp_free(resp);
+		}
+	} else if (event_filter) {
+		conn_install_filters(conn);
+	}
+	return 0;
+}
+
+/*! \brief Connect and log in to a server, using as many connections as configured */
+static int session_connect(struct session *session)
+{
+	int i;
+
+	for (i = 0; i < session->nconns; i++) {
+		if (conn_connect(&session->conns[i], 0)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void session_destroy(struct session *session)
+{
+	int i;
+
+	for (i = 0; i < session->nconns; i++) {
+		if (session->conns[i].ami) {
+			ami_disconnect(session->conns[i].ami);
+			ami_destroy(session->conns[i].ami);
+		}
+		pthread_cond_destroy(&session->conns[i].pipeline_cond);
+	}
+	free(session->conns);
+	session->conns = NULL;
+	session->nconns = 0;
+	chan_index_destroy(session);
+	orphans_destroy(session);
+}
+
+/*!
+ * \brief Rebuild a server's channel index and line state from a snapshot of its channels
+ * \param session
+ * \param ami Session to use for the snapshot
+ * \param[out] up Number of lines that are still off hook
+ * \param[out] dropped Number of lines that went on hook (or failed to go off hook) while we weren't looking
+ * \retval 0 on success, -1 on failure
+ */
+static int session_resync(struct session *session, struct ami_session *ami, int *up, int *dropped)
+{
+	struct ami_response *resp;
+	int i, n;
+	int64_t start;
+
+	*up = *dropped = 0;
+
+	start = monotonic_ns();
+	resp = ami_action_show_channels(ami);
+	stats_record(STAT_SHOWCHANNELS, monotonic_ns() - start, resp && resp->success);
+	if (!resp) {
+		return -1;
+	}
+	chan_index_destroy(session);
+	/* Any OriginateResponse events during the outage are gone, so the snapshot is all we have to go on */
+	orphans_destroy(session);
+
+	pthread_mutex_lock(&lines_lock);
+	for (n = session->first_line; n <= session->last_line; n++) {
+		line_set_state(n, LS_IDLE);
+		if (!lines[n].answering) {
+			lines[n].inbound[0] = '\0'; /* If it's still ringing, we'll find it again */
+		}
+	}
+	for (i = 1; i < resp->size - 1; i++) {
+		const char *channel = ami_keyvalue(resp->events[i], "Channel");
+		if (channel && *channel) {
+			const char *tmp = ami_keyvalue(resp->events[i], "ChannelState");
+			int state = tmp ? atoi(tmp) : 0;
+			chan_index_add(session, channel);
+			n = line_from_channel(session, channel);
+			if (!n) {
+				continue;
+			} else if (state == 4 && strcmp(channel, lines[n].channel)) {
+				line_incoming(n, channel); /* Still ringing, though we can't tell for how long */
+			} else {
+				line_set_state(n, state == 6 ? LS_UP : state == 5 ? LS_RINGING : LS_DIALING);
+			}
+		}
+	}
+	ami_resp_free(resp);
+
+	for (n = session->first_line; n <= session->last_line; n++) {
+		if (!lines[n].offhook && !lines[n].originating) {
+			continue;
+		}
+		if (chan_index_find(session, lines[n].devicename, lines[n].channel, sizeof(lines[n].channel))) {
+			if (lines[n].originating) {
+				originate_complete(n, 0, "");
+			} else {
+				line_set_offhook(n, 0);
+				fprintf(stderr, "Line %d went on hook during the outage\n", n);
+			}
+			(*dropped)++;
+		} else {
+			if (lines[n].originating) {
+				originate_complete(n, 1, lines[n].channel);
+			}
+			(*up)++;
+		}
+	}
+	pthread_mutex_unlock(&lines_lock);
+	return 0;
+}
+
+/*! \brief Reconnect a dropped connection, retrying with backoff until it works (or we're shutting down) */
+static void conn_reconnect(struct ami_conn *conn)
+{
+	struct ami_session *old;
+	struct timespec ts;
+	int64_t deadline;
+	int delay = RECONNECT_MIN_DELAY_MS, up = 0, dropped = 0, resynced = 0;
+
+	/* The old session is dead, get rid of it (the disconnect callback has already fired for it).
+	 * Workers may still be in the middle of actions on it, which will fail now that it's disconnected,
+	 * so wait for them to give up before destroying it. */
+	pthread_mutex_lock(&pipeline_lock);
+	old = conn->ami;
+	conn->ami = NULL;
+	while (conn->inflight) {
+		pthread_cond_wait(&pipeline_done_cond, &pipeline_lock);
+	}
+	pthread_mutex_unlock(&pipeline_lock);
+	if (old) {
+		ami_destroy(old);
+	}
+
+	for (;;) {
+		if (!conn_connect(conn, 1)) {
+			break;
+		}
+		fprintf(stderr, "Failed to reconnect to %s, retrying in %.1f s\n", conn->session->name, (double) delay / 1000.0);
+		deadline = monotonic_ns() + (int64_t) delay * 1000000LL;
+		ts.tv_sec = deadline / 1000000000LL;
+		ts.tv_nsec = deadline % 1000000000LL;
+		pthread_mutex_lock(&pipeline_lock);
+		while (!reconnect_shutdown && monotonic_ns() < deadline) {
+			pthread_cond_timedwait(&reconnect_cond, &pipeline_lock, &ts);
+		}
+		pthread_mutex_unlock(&pipeline_lock);
+		if (reconnect_shutdown) {
+			return;
+		}
+		delay = delay * 2 > RECONNECT_MAX_DELAY_MS ? RECONNECT_MAX_DELAY_MS : delay * 2;
+	}
+
+	if (!conn->index) {
+		/* This is the connection we get events on, so we missed everything while it was down */
+		resynced = !session_resync(conn->session, conn->ami, &up, &dropped);
+		if (!resynced) {
+			fprintf(stderr, "Failed to get channels from %s, line state may be stale\n", conn->session->name);
+		}
+	}
+
+	pthread_mutex_lock(&pipeline_lock);
+	fprintf(stderr, "Reconnected to %s after %.1f s", conn->session->name, (double) (monotonic_ns() - conn->down_since) / 1000000000.0);
+	if (resynced) {
+		fprintf(stderr, " (%d line%s still off hook, %d hung up during the outage)", up, ESS(up), dropped);
+	}
+	fprintf(stderr, "\n");
+	conn->down = 0;
+	pthread_cond_broadcast(&conn->pipeline_cond); /* Resume any queued actions */
+	pthread_mutex_unlock(&pipeline_lock);
+}
+
+static void *reconnect_loop(void *varg)
+{
+	(void) varg;
+
+	for (;;) {
+		struct ami_conn *conn = NULL;
+		int i, j;
+
+		pthread_mutex_lock(&pipeline_lock);
+		while (!reconnect_shutdown) {
+			for (i = 0; !conn && i < num_sessions; i++) {
+				for (j = 0; !conn && j < sessions[i].nconns; j++) {
+					if (sessions[i].conns[j].down) {
+						conn = &sessions[i].conns[j];
+					}
+				}
+			}
+			if (conn) {
+				break;
+			}
+			pthread_cond_wait(&reconnect_cond, &pipeline_lock);
+		}
+		pthread_mutex_unlock(&pipeline_lock);
+		if (!conn) {
+			break;
+		}
+		conn_reconnect(conn);
+	}
+	return NULL;
+}
+
+static int reconnect_start(void)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&reconnect_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (pthread_create(&reconnect_thread, NULL, reconnect_loop, NULL)) {
+		fprintf(stderr, "Failed to create reconnect thread: %s\n", strerror(errno));
+		return -1;
+	}
+	reconnect_started = 1;
+	return 0;
+}
+
+/*! \brief Stop reconnecting. After this, disconnects are ignored. */
+static void reconnect_stop(void)
+{
+	pthread_mutex_lock(&pipeline_lock);
+	reconnect_shutdown = 1;
+	pthread_cond_broadcast(&reconnect_cond);
+	pthread_mutex_unlock(&pipeline_lock);
+	if (reconnect_started) {
+		pthread_join(reconnect_thread, NULL);
+		reconnect_started = 0;
+	}
+	pthread_cond_destroy(&reconnect_cond);
+}
+
+/*! \brief Output built up in memory and then written all at once */
+struct strbuf {
+	char *buf;
+	size_t len;
+	size_t alloc;
+};
+
+static void strbuf_printf(struct strbuf *b, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+
+static void strbuf_printf(struct strbuf *b, const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+
+	for (;;) {
+		va_start(ap, fmt);
+		len = vsnprintf(b->buf + b->len, b->alloc - b->len, fmt, ap);
+		va_end(ap);
+		if (len < 0) {
+			return;
+		} else if (b->len + len < b->alloc) {
+			b->len += len;
+			return;
+		} else {
+			size_t alloc = b->alloc ? b->alloc * 2 : 8192;
+			char *newbuf = realloc(b->buf, alloc);
+			if (!newbuf) {
+				return;
+			}
+			b->buf = newbuf;
+			b->alloc = alloc;
+		}
+	}
+}
+
+/*
+ * Dashboard
+ *
+ * A live view of the state of every line at the top of the screen, with commands and their output
+ * scrolling underneath it. It's redrawn at most DASHBOARD_FPS times a second, and then only the
+ * lines that changed, so it stays cheap even with thousands of lines.
+ */
+
+#define DASHBOARD_FPS 10
+#define DASHBOARD_CELL_WIDTH 16
+#define DASHBOARD_MIN_OUTPUT_ROWS 8
+
+static int dashboard = 0;
+static int dashboard_running = 0;
+static int dashboard_shutdown = 0;
+static pthread_t dashboard_thread;
+static volatile sig_atomic_t dashboard_resized = 0;
+static unsigned int *drawn_versions = NULL;	/* Version of each line when it was last drawn */
+
+static const char *state_colors[LS_MAX] = {
+	[LS_IDLE] = "\e[2m",
+	[LS_DIALING] = "\e[33m",
+	[LS_RINGING] = "\e[1;35m",
+	[LS_UP] = "\e[32m",
+	[LS_HELD] = "\e[34m",
+	[LS_CONF] = "\e[36m",
+};
+
+/*! \brief Screen layout */
+struct dash_layout {
+	int rows;
+	int per_row;	/* Lines per row of the grid */
+	int grid_rows;	/* Rows of the grid that fit on the screen */
+	int visible;	/* Number of lines shown */
+};
+
+static void sigwinch_handler(int num)
+{
+	dashboard_resized = 1;
+}
+
+static void dashboard_layout(struct dash_layout *layout)
+{
+	struct winsize ws;
+	int cols, max_rows;
+
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) || !ws.ws_row || !ws.ws_col) {
+		ws.ws_row = 24;
+		ws.ws_col = 80;
+	}
+	layout->rows = ws.ws_row;
+	cols = ws.ws_col;
+	layout->per_row = cols / DASHBOARD_CELL_WIDTH;
+	if (layout->per_row < 1) {
+		layout->per_row = 1;
+	}
+	layout->grid_rows = (num_lines + layout->per_row - 1) / layout->per_row;
+	/* Leave a row for the summary and one for the separator, and room for output */
+	max_rows = layout->rows - 2 - DASHBOARD_MIN_OUTPUT_ROWS;
+	if (max_rows < 1) {
+		max_rows = 1;
+	}
+	if (layout->grid_rows > max_rows) {
+		layout->grid_rows = max_rows;
+	}
+	layout->visible = layout->grid_rows * layout->per_row;
+	if (layout->visible > num_lines) {
+		layout->visible = num_lines;
+	}
+}
+
+/*!
+ * \brief Draw a frame of the dashboard
+ * \param b Buffer to use
+ * \param layout
+ * \param full Redraw everything, and set up the scrolling region for output
+ */
+static void dashboard_draw(struct strbuf *b, struct dash_layout *layout, int full)
+{
+	size_t written = 0;
+	int i, n;
+
+	b->len = 0;
+	strbuf_printf(b, "\e7"); /* Save the cursor */
+	if (full) {
+		for (i = 1; i <= layout->grid_rows + 1; i++) {
+			strbuf_printf(b, "\e[%d;1H\e[2K", i);
+		}
+		strbuf_printf(b, "\e[%d;1H\e[2K", layout->grid_rows + 2);
+		for (i = 0; i < layout->per_row * DASHBOARD_CELL_WIDTH; i++) {
+			strbuf_printf(b, "-");
+		}
+	}
+
+	/* Summary */
+	strbuf_printf(b, "\e[1;1H\e[2K\e[1mAstMultiDialer\e[0m  %d line%s:", num_lines, ESS(num_lines));
+	for (i = 0; i < LS_MAX; i++) {
+		strbuf_printf(b, "  %s%.4s %d\e[0m", state_colors[i], state_names[i], __atomic_load_n(&state_counts[i], __ATOMIC_RELAXED));
+	}
+	if (layout->visible < num_lines) {
+		strbuf_printf(b, "  (showing 1-%d)", layout->visible);
+	}
+
+	/* Only redraw lines that changed since the last frame */
+	for (n = 1; n <= layout->visible; n++) {
+		unsigned int version = __atomic_load_n(&lines[n].version, __ATOMIC_ACQUIRE);
+		enum line_state state;
+		char dtmf[sizeof(lines[n].dtmf)];
+		if (!full && drawn_versions[n] == version) {
+			continue;
+		}
+		drawn_versions[n] = version;
+		state = lines[n].state < LS_MAX ? lines[n].state : LS_IDLE;
+		memcpy(dtmf, lines[n].dtmf, sizeof(dtmf));
+		dtmf[sizeof(dtmf) - 1] = '\0';
+		strbuf_printf(b, "\e[%d;%dH%s%5d %-4.4s %s%-4s\e[0m ", 2 + (n - 1) / layout->per_row, 1 + ((n - 1) % layout->per_row) * DASHBOARD_CELL_WIDTH,
+			state_colors[state], n, state_names[state], lines[n].dtmf_active ? "\e[7m" : "", dtmf);
+	}
+
+	if (full) {
+		/* Setting the scrolling region homes the cursor, so put it at the bottom instead of restoring it */
+		strbuf_printf(b, "\e[%d;%dr\e[%d;1H", layout->grid_rows + 3, layout->rows, layout->rows);
+	} else {
+		strbuf_printf(b, "\e8");
+	}
+
+	while (written < b->len) {
+		ssize_t res = write(STDOUT_FILENO, b->buf + written, b->len - written);
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		written += res;
+	}
+}
+
+static void *dashboard_loop(void *varg)
+{
+	struct strbuf b;
+	struct dash_layout layout;
+	struct timespec frame;
+	int full = 1;
+
+	memset(&b, 0, sizeof(b));
+	frame.tv_sec = 0;
+	frame.tv_nsec = 1000000000L / DASHBOARD_FPS;
+	dashboard_layout(&layout);
+
+	while (!__atomic_load_n(&dashboard_shutdown, __ATOMIC_ACQUIRE)) {
+		if (dashboard_resized) {
+			dashboard_resized = 0;
+			dashboard_layout(&layout);
+			full = 1;
+		}
+		if (full || __atomic_exchange_n(&state_changed, 0, __ATOMIC_ACQ_REL)) {
+			dashboard_draw(&b, &layout, full);
+			full = 0;
+		}
+		nanosleep(&frame, NULL);
+	}
+
+	free(b.buf);
+	return NULL;
+}
+
+static int dashboard_start(void)
+{
+	struct sigaction sa;
+
+	if (!isatty(STDOUT_FILENO)) {
+		fprintf(stderr, "Not showing the dashboard, since output is not a terminal\n");
+		return 0;
+	}
+	drawn_versions = calloc(num_lines + 1, sizeof(*drawn_versions));
+	if (!drawn_versions) {
+		return -1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sigwinch_handler;
+	sa.sa_flags = SA_RESTART; /* Don't interrupt AMI I/O */
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGWINCH, &sa, NULL);
+
+	if (pthread_create(&dashboard_thread, NULL, dashboard_loop, NULL)) {
+		fprintf(stderr, "Failed to create dashboard thread: %s\n", strerror(errno));
+		free(drawn_versions);
+		drawn_versions = NULL;
+		return -1;
+	}
+	dashboard_running = 1;
+	return 0;
+}
+
+static void dashboard_stop(void)
+{
+	struct winsize ws;
+
+	if (!dashboard_running) {
+		return;
+	}
+	__atomic_store_n(&dashboard_shutdown, 1, __ATOMIC_RELEASE);
+	pthread_join(dashboard_thread, NULL);
+	dashboard_running = 0;
+	free(drawn_versions);
+	drawn_versions = NULL;
+
+	/* Reset the scrolling region, and leave the cursor at the bottom */
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) || !ws.ws_row) {
+		ws.ws_row = 24;
+	}
+	printf("\e[r\e[%d;1H\n", ws.ws_row);
+	fflush(stdout);
+}
+
+/*
+ * Metrics
+ *
+ * An optional HTTP endpoint serving the dialer's counters in the Prometheus text format, for scraping during load runs.
+ * Everything exported is either an atomic counter that's updated anyway, or cheap to compute when scraped,
+ * so nothing extra is done on the command or event paths while it's enabled.
+ */
+
+#define METRICS_MAX_REQUEST 4096
+#define METRICS_READ_TIMEOUT_MS 2000
+
+static char metrics_listen[64] = "";	/* [host:]port */
+static int metrics_fd = -1;
+static int metrics_pipe[2] = { -1, -1 };	/* Written to on shutdown, to wake up the server thread */
+static pthread_t metrics_thread;
+
+/* Latency histogram bucket boundaries, in seconds */
+static const double metrics_buckets[] = { 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30 };
+
+/*!
+ * \brief Export a latency histogram as a Prometheus histogram
+ * \note Our buckets are finer than these, so each of ours is counted under the first boundary its upper bound fits in.
+ *       Like the percentiles, this is accurate to within about 6%.
+ */
+static void metrics_hist(struct strbuf *b, const char *name, const char *label, struct latency_hist *hist)
+{
+	uint64_t count = __atomic_load_n(&hist->count, __ATOMIC_ACQUIRE);
+	uint64_t seen = 0;
+	size_t i;
+	int bucket = 0;
+
+	for (i = 0; i < sizeof(metrics_buckets) / sizeof(metrics_buckets[0]); i++) {
+		uint64_t limit = (uint64_t) (metrics_buckets[i] * 1000000.0);
+		while (bucket < HIST_BUCKETS && hist_value(bucket) <= limit) {
+			seen += __atomic_load_n(&hist->buckets[bucket++], __ATOMIC_RELAXED);
+		}
+		strbuf_printf(b, "%s_bucket{%s%sle=\"%g\"} %lu\n", name, label, *label ? "," : "", metrics_buckets[i], (unsigned long) (seen < count ? seen : count));
+	}
+	strbuf_printf(b, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, label, *label ? "," : "", (unsigned long) count);
+	strbuf_printf(b, "%s_sum%s%s%s %.6f\n", name, *label ? "{" : "", label, *label ? "}" : "", (double) __atomic_load_n(&hist->sum, __ATOMIC_RELAXED) / 1000000.0);
+	strbuf_printf(b, "%s_count%s%s%s %lu\n", name, *label ? "{" : "", label, *label ? "}" : "", (unsigned long) count);
+}
+
+static void metrics_render(struct strbuf *b)
+{
+	char label[64];
+	int i, n, offhook = 0, originating = 0, answering = 0, conns_up = 0, conns = 0, outstanding;
+
+	/* Actions */
+	strbuf_printf(b, "# HELP astmultidialer_actions_total AMI actions completed.\n# TYPE astmultidialer_actions_total counter\n");
+	for (i = 0; i <= STAT_OTHER; i++) {
+		strbuf_printf(b, "astmultidialer_actions_total{action=\"%s\"} %lu\n", stat_names[i], (unsigned long) __atomic_load_n(&stats[i].count, __ATOMIC_RELAXED));
+	}
+	strbuf_printf(b, "# HELP astmultidialer_action_failures_total AMI actions that failed or got no response.\n# TYPE astmultidialer_action_failures_total counter\n");
+	for (i = 0; i <= STAT_OTHER; i++) {
+		strbuf_printf(b, "astmultidialer_action_failures_total{action=\"%s\"} %lu\n", stat_names[i], (unsigned long) __atomic_load_n(&stats[i].errors, __ATOMIC_RELAXED));
+	}
+	strbuf_printf(b, "# HELP astmultidialer_action_latency_seconds AMI action round trip time.\n# TYPE astmultidialer_action_latency_seconds histogram\n");
+	for (i = 0; i <= STAT_OTHER; i++) {
+		snprintf(label, sizeof(label), "action=\"%s\"", stat_names[i]);
+		metrics_hist(b, "astmultidialer_action_latency_seconds", label, &stats[i]);
+	}
+	strbuf_printf(b, "# HELP astmultidialer_ring_to_answer_seconds How long inbound calls rang before they were answered.\n# TYPE astmultidialer_ring_to_answer_seconds histogram\n");
+	metrics_hist(b, "astmultidialer_ring_to_answer_seconds", "", &stats[STAT_RING_ANSWER]);
+	strbuf_printf(b, "# HELP astmultidialer_answer_failures_total Inbound calls that couldn't be answered.\n# TYPE astmultidialer_answer_failures_total counter\n");
+	strbuf_printf(b, "astmultidialer_answer_failures_total %lu\n", (unsigned long) __atomic_load_n(&stats[STAT_RING_ANSWER].errors, __ATOMIC_RELAXED));
+
+	pthread_mutex_lock(&pipeline_lock);
+	outstanding = jobs_outstanding;
+	for (i = 0; i < num_sessions; i++) {
+		for (n = 0; n < sessions[i].nconns; n++) {
+			conns++;
+			conns_up += !sessions[i].conns[n].down;
+		}
+	}
+	pthread_mutex_unlock(&pipeline_lock);
+	strbuf_printf(b, "# HELP astmultidialer_actions_in_flight AMI actions queued or in progress.\n# TYPE astmultidialer_actions_in_flight gauge\n");
+	strbuf_printf(b, "astmultidialer_actions_in_flight %d\n", outstanding);
 
-#define MAX_LINES 9
+	/* Commands */
+	strbuf_printf(b, "# HELP astmultidialer_commands_total Commands executed.\n# TYPE astmultidialer_commands_total counter\n");
+	for (i = 0; i < NUM_OPCODES; i++) {
+		if (i != OP_NONE) {
+			strbuf_printf(b, "astmultidialer_commands_total{command=\"%s\"} %lu\n", op_names[i], (unsigned long) __atomic_load_n(&commands_executed[i], __ATOMIC_RELAXED));
+		}
+	}
 
-static struct line lines[MAX_LINES + 1]; /* Leave index 0 unused for simplicitly, so we can use it 1-indexed. */
+	/* Lines */
+	offhook = __atomic_load_n(&lines_offhook, __ATOMIC_RELAXED);
+	originating = __atomic_load_n(&lines_originating, __ATOMIC_RELAXED);
+	answering = __atomic_load_n(&lines_answering, __ATOMIC_RELAXED);
+	strbuf_printf(b, "# HELP astmultidialer_lines Number of lines.\n# TYPE astmultidialer_lines gauge\nastmultidialer_lines %d\n", num_lines);
+	strbuf_printf(b, "# HELP astmultidialer_lines_offhook Lines that are off hook.\n# TYPE astmultidialer_lines_offhook gauge\nastmultidialer_lines_offhook %d\n", offhook);
+	strbuf_printf(b, "# HELP astmultidialer_originates_in_flight Lines going off hook that haven't gotten an OriginateResponse yet.\n# TYPE astmultidialer_originates_in_flight gauge\n");
+	strbuf_printf(b, "astmultidialer_originates_in_flight %d\n", originating);
+	strbuf_printf(b, "# HELP astmultidialer_answers_in_flight Lines with an answer in progress.\n# TYPE astmultidialer_answers_in_flight gauge\nastmultidialer_answers_in_flight %d\n", answering);
+	strbuf_printf(b, "# HELP astmultidialer_line_state Lines in each state, as seen from events.\n# TYPE astmultidialer_line_state gauge\n");
+	for (i = 0; i < LS_MAX; i++) {
+		strbuf_printf(b, "astmultidialer_line_state{state=\"%s\"} %d\n", state_names[i], __atomic_load_n(&state_counts[i], __ATOMIC_RELAXED));
+	}
 
-/*! \brief Callback function executing asynchronously when new events are available */
-static void ami_callback(struct ami_session *ami, struct ami_event *event)
-{
-	(void) ami;
-	ami_event_free(event); /* Discard all events. We don't need them. */
+	/* Connections and events */
+	strbuf_printf(b, "# HELP astmultidialer_connections AMI connections.\n# TYPE astmultidialer_connections gauge\nastmultidialer_connections %d\n", conns);
+	strbuf_printf(b, "# HELP astmultidialer_connections_up AMI connections that are currently connected.\n# TYPE astmultidialer_connections_up gauge\nastmultidialer_connections_up %d\n", conns_up);
+	strbuf_printf(b, "# HELP astmultidialer_events_received_total AMI events received.\n# TYPE astmultidialer_events_received_total counter\nastmultidialer_events_received_total %lu\n",
+		(unsigned long) __atomic_load_n(&events_received, __ATOMIC_RELAXED));
+	strbuf_printf(b, "# HELP astmultidialer_event_bytes_received_total Approximate size of AMI events received.\n# TYPE astmultidialer_event_bytes_received_total counter\nastmultidialer_event_bytes_received_total %lu\n",
+		(unsigned long) __atomic_load_n(&event_bytes_received, __ATOMIC_RELAXED));
+	strbuf_printf(b, "# HELP astmultidialer_calllog_dropped_total Call log records dropped because the log couldn't keep up.\n# TYPE astmultidialer_calllog_dropped_total counter\nastmultidialer_calllog_dropped_total %lu\n",
+		(unsigned long) __atomic_load_n(&calllog_drops, __ATOMIC_RELAXED));
 }
 
-static void simple_disconnect_callback(struct ami_session *ami)
+/*!
+ * \brief Write all of a buffer to a socket
+ * \note If the scraper has gone away, this fails with EPIPE, rather than SIGPIPE killing the whole run
+ */
+static int send_all(int fd, const char *buf, size_t len)
 {
-	(void) ami;
-	fprintf(stderr, "\nAMI was forcibly disconnected...\n");
-	tcsetattr(STDIN_FILENO, TCSANOW, &origterm); /* Restore the original term settings */
-	exit(EXIT_FAILURE);
+	while (len) {
+		ssize_t res = send(fd, buf, len, MSG_NOSIGNAL);
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		buf += res;
+		len -= (size_t) res;
+	}
+	return 0;
 }
 
-static void hangup_all(struct ami_session *ami)
+static void metrics_handle(int fd)
 {
-	int i;
+	char req[METRICS_MAX_REQUEST];
+	size_t len = 0;
+	struct strbuf body;
+	char header[256];
+	int hlen;
 
-	for (i = 1; i <= MAX_LINES; i++) {
-		if (lines[i].offhook) {
-			struct ami_response *resp = ami_action(ami, "Hangup", "Channel:%s\r\nCause:%d", lines[i].channel, 16);
-			if (resp && resp->success) {
-				fprintf(stderr, "Hung up line %d\n", i);
-				lines[i].offhook = 0;
-			}
-			if (resp) {
-				ami_resp_free(resp);
-			}
+	/* Read the request headers. We don't care what's in them, other than the request line. */
+	for (;;) {
+		struct pollfd pfd;
+		ssize_t res;
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, METRICS_READ_TIMEOUT_MS) <= 0) {
+			return;
 		}
+		res = read(fd, req + len, sizeof(req) - 1 - len);
+		if (res <= 0) {
+			return;
+		}
+		len += (size_t) res;
+		req[len] = '\0';
+		if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n")) {
+			break;
+		} else if (len == sizeof(req) - 1) {
+			return; /* Too big */
+		}
+	}
+
+	if (strncmp(req, "GET /metrics ", 13) && strncmp(req, "GET / ", 6)) {
+		const char *msg = "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: 10\r\nConnection: close\r\n\r\nNot Found\n";
+		send_all(fd, msg, strlen(msg));
+		return;
+	}
+
+	memset(&body, 0, sizeof(body));
+	metrics_render(&body);
+	if (!body.buf) {
+		return;
+	}
+	hlen = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\nContent-Length: %lu\r\nConnection: close\r\n\r\n",
+		(unsigned long) body.len);
+	if (!send_all(fd, header, (size_t) hlen)) {
+		send_all(fd, body.buf, body.len);
 	}
+	free(body.buf);
 }
 
-static void restore_term(int num)
+/*! \brief Serve metrics requests, one at a time (scrapes are infrequent) */
+static void *metrics_loop(void *varg)
 {
-	/* Be nice and restore the terminal to how it was before, before we exit. */
-	tcsetattr(STDIN_FILENO, TCSANOW, &origterm); /* Restore the original term settings */
-	fprintf(stderr, "\n");
+	struct pollfd pfds[2];
 
-	if (global_ami) {
-		/* Hang up any lines still active */
-		hangup_all(global_ami);
-		ami_disconnect(global_ami);
-		ami_destroy(global_ami);
+	pfds[0].fd = metrics_fd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = metrics_pipe[0];
+	pfds[1].events = POLLIN;
+	for (;;) {
+		int fd;
+		if (poll(pfds, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		if (pfds[1].revents) {
+			break;
+		}
+		fd = accept(metrics_fd, NULL, NULL);
+		if (fd < 0) {
+			continue;
+		}
+		metrics_handle(fd);
+		close(fd);
 	}
-
-	fprintf(stderr, "\nAstMultiDialer exiting...\n");
-	exit(EXIT_FAILURE);
+	return NULL;
 }
 
-static int find_channel(struct ami_session *ami, int n)
+static int metrics_start(void)
 {
-	int i, found = 0;
-	struct ami_response *resp;
-	const char *prefix = lines[n].devicename;
-	int prefixlen;
+	struct sockaddr_in sin;
+	char host[64];
+	const char *port;
+	int on = 1;
 
-	/* Originate action doesn't give us the new channel name, so try to find it,
-	 * assuming there's only one channel with the prefix of the device name */
+	if (!metrics_listen[0]) {
+		return 0;
+	}
 
-	resp = ami_action_show_channels(ami);
-	if (!resp) {
-		fprintf(stderr, "Failed to show channels\n");
+	/* Only listen locally, unless told otherwise */
+	snprintf(host, sizeof(host), "%s", metrics_listen);
+	port = strrchr(host, ':');
+	if (port) {
+		host[port - host] = '\0';
+		port = metrics_listen + (port - host) + 1;
+	} else {
+		port = metrics_listen;
+		strcpy(host, "127.0.0.1");
+	}
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons((uint16_t) atoi(port));
+	if (!atoi(port) || inet_pton(AF_INET, *host ? host : "0.0.0.0", &sin.sin_addr) != 1) {
+		fprintf(stderr, "Invalid metrics address '%s'\n", metrics_listen);
 		return -1;
 	}
 
-	prefixlen = strlen(prefix);
-	for (i = 1; i < resp->size - 1; i++) {
-		const char *channel = ami_keyvalue(resp->events[i], "Channel");
-		if (!strncmp(channel, prefix, prefixlen)) {
-			strncpy(lines[n].channel, channel, sizeof(lines[n].channel) - 1);
-			found = 1;
-			break;
-		}
+	metrics_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (metrics_fd < 0) {
+		fprintf(stderr, "socket failed: %s\n", strerror(errno));
+		return -1;
 	}
-	if (!found) {
-		fprintf(stderr, "Failed to find channel for %s\n", lines[n].devicename);
+	setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (bind(metrics_fd, (struct sockaddr *) &sin, sizeof(sin)) || listen(metrics_fd, 8)) {
+		fprintf(stderr, "Failed to listen for metrics on %s: %s\n", metrics_listen, strerror(errno));
+		close(metrics_fd);
+		metrics_fd = -1;
+		return -1;
 	}
-	return found ? 0 : -1;
+	if (pipe(metrics_pipe)) {
+		fprintf(stderr, "pipe failed: %s\n", strerror(errno));
+		close(metrics_fd);
+		metrics_fd = -1;
+		return -1;
+	}
+	if (pthread_create(&metrics_thread, NULL, metrics_loop, NULL)) {
+		fprintf(stderr, "Failed to start metrics server: %s\n", strerror(errno));
+		close(metrics_pipe[0]);
+		close(metrics_pipe[1]);
+		metrics_pipe[0] = metrics_pipe[1] = -1;
+		close(metrics_fd);
+		metrics_fd = -1;
+		return -1;
+	}
+	return 0;
 }
 
-#define REQUIRE_RESP(resp) if (!resp) { fprintf(stderr, "No response\n"); return 0; }
-#define REQUIRE_ACTIVE() if (!lines[n].offhook) { fprintf(stderr, "Can't do this action on on-hook line\n"); return 0; }
-
-#define ltrim(s) \
-	while (isspace(*s)) { \
-		s++; \
+static void metrics_stop(void)
+{
+	if (metrics_fd < 0) {
+		return;
+	}
+	if (write(metrics_pipe[1], "", 1) < 0) {
+		/* Can't happen, but if it did, the join would hang */
+		pthread_cancel(metrics_thread);
 	}
+	pthread_join(metrics_thread, NULL);
+	close(metrics_pipe[0]);
+	close(metrics_pipe[1]);
+	close(metrics_fd);
+	metrics_fd = -1;
+}
 
-static int run_command(struct ami_session *ami, char *command)
+static int multidialer(struct script *script)
 {
-	struct ami_response *resp;
-	char *tmp;
-	int n = 0;
+	struct sigaction sa;
+	int i;
 
-	tmp = strchr(command, ';'); /* Ignore comments. Use ; instead of # since # is a DTMF digit. */
-	if (tmp) {
-		*tmp = '\0';
+	if (pipe(sigint_pipe)) {
+		fprintf(stderr, "pipe failed: %s\n", strerror(errno));
+		return -1;
 	}
 
-	/* Get line number, if applicable. */
-	if (isdigit(*command)) {
-		n = atoi(command);
-		if (!n) {
-			fprintf(stderr, "Line number must be between 1 and 9\n");
-			return 0;
-		}
-		command++;
-		ltrim(command);
+	/* Setup a signal handler for SIGINT, so we can clean up and restore the terminal.
+	 * No SA_RESTART, so that sleeps, reads and poll are interrupted. */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sigint_handler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+
+	interactive = !script && isatty(STDIN_FILENO);
+
+	if (interactive) {
+		tcgetattr(STDIN_FILENO, &origterm);
+		ttyterm = origterm;
+
+		/* Set up the terminal */
+		ttyterm.c_lflag &= ~ICANON; /* Disable canonical mode to disable input buffering. Needed so poll works correctly on STDIN_FILENO */
+		tcsetattr(STDIN_FILENO, TCSANOW, &ttyterm); /* Apply changes */
+		run_interactive();
+	} else if (script) {
+		script_run(script);
+	} else {
+		run_stream(STDIN_FILENO);
 	}
 
-	/* Parse command */
-	if (n) { /* Line command */
-		tmp = command;
-		snprintf(lines[n].devicename, sizeof(lines[n].devicename), "PJSIP/%s%d", PEER_PREFIX, n);
-		snprintf(lines[n].dialstr, sizeof(lines[n].dialstr), "PJSIP/%s@%s%d", PLAR_CODE, PEER_PREFIX, n);
-		snprintf(lines[n].dialexten, sizeof(lines[n].dialexten), PLAR_DIALPLAN_CONTEXT);
-		switch (tolower(*command++)) {
-			case 'a': /* answer (off hook) */
-				/*! \todo add */
-				fprintf(stderr, "XXX Not implemented yet\n");
-				break;
-			case 'o': /* originate (off hook) */
-				resp = ami_action(ami, "Originate", "Channel:%s\r\nContext:%s\r\nExten:%s\r\nPriority:%s", lines[n].dialstr, lines[n].dialexten, PLAR_DIALPLAN_EXTEN, "1", NULL);
-				REQUIRE_RESP(resp);
-				if (resp && resp->success) {
-					lines[n].offhook = 1;
-					if (!find_channel(ami, n)) {
-						fprintf(stderr, "OK\n");
-					}
-				} else {
-					fprintf(stderr, "Failed to go off hook on line %d\n", n);
-				}
-				ami_resp_free(resp);
-				break;
-			case 'h': /* on hook */
-				REQUIRE_ACTIVE();
-				resp = ami_action(ami, "Hangup", "Channel:%s\r\nCause:%d", lines[n].channel, 16);
-				REQUIRE_RESP(resp);
-				if (resp && resp->success) {
-					lines[n].offhook = 0;
-					fprintf(stderr, "OK\n");
-				} else {
-					fprintf(stderr, "Failed to go on hook on line %d\n", n);
-				}
-				ami_resp_free(resp);
-				break;
-			case 'f': /* flash */
-				REQUIRE_ACTIVE();
-				resp = ami_action(ami, "SendFlash", "Channel:%s", lines[n].channel);
-				REQUIRE_RESP(resp);
-				if (resp && resp->success) {
-					fprintf(stderr, "OK\n");
-				} else {
-					fprintf(stderr, "Failed to send flash on line %d\n", n);
-				}
-				ami_resp_free(resp);
-				break;
-			case 'd': /* dial */
-				REQUIRE_ACTIVE();
-				tmp = command++;
-				if (*tmp== 't') {
-					/* The PlayDTMF action is kind of silly. You have to do it once digit at a time.
-					 * However, we can send all the digits at once without waiting, and the channel will queue them up. */
-					while (*command) {
-						resp = ami_action(ami, "PlayDTMF", "Channel:%s\r\nDigit:%c", lines[n].channel, *command);
-						command++;
-					}
-				} else if (*tmp == 'p') {
-					fprintf(stderr, "Dial pulse not yet supported\n");
-				} else {
-					fprintf(stderr, "Invalid dial type %c\n", *tmp);
-				}
-				break;
-			default:
-				fprintf(stderr, "Unknown line command '%c'\n", *tmp);
-		}
-	} else { /* Global command */
-		int sleeptime;
-		if (*command == 's') {
-			command++;
-			ltrim(command);
-			sleeptime = atoi(command);
-			sleep(sleeptime);
-		} else if (!strncasecmp(command, "ms", 2)) {
-			command += 2;
-			ltrim(command);
-			sleeptime = atoi(command);
-			usleep(sleeptime * 1000);
-		} else if (!strcasecmp(command, "q")) {
-			return -1;
-		} else if (!strcasecmp(command, "k")) {
-			hangup_all(ami);
-		} else {
-			fprintf(stderr, "Unknown global command '%s'\n", command);
+	if (got_sigint) {
+		/* Be nice and restore the terminal to how it was before, before we exit. */
+		if (interactive) {
+			tcsetattr(STDIN_FILENO, TCSANOW, &origterm); /* Restore the original term settings */
 		}
+		fprintf(stderr, "\n");
+		/* Hang up any lines still active */
+		hangup_all();
 	}
 
-	return 0;
-}
+	dashboard_stop();
+	metrics_stop();
+	auto_answer_stop();
+	pulse_stop();
+	reconnect_stop();
+	pipeline_stop();
+	for (i = 0; i < num_sessions; i++) {
+		session_destroy(&sessions[i]);
+	}
+	calllog_stop(); /* Only once events have stopped, since an OriginateResponse can still be logged until then */
+	free(lines);
+	free(line_index);
+	free(line_overrides);
+	if (script) {
+		script_free(script);
+	}
+	if (interactive) {
+		tcsetattr(STDIN_FILENO, TCSANOW, &origterm); /* Restore the original term settings */
+	}
+	close(sigint_pipe[0]);
+	close(sigint_pipe[1]);
+	if (sched_timerfd >= 0) {
+		close(sched_timerfd);
+	}
 
-static void show_command_help(void)
-{
-	printf(
-		"\r"
-		"Usage: [<line #>] command [arguments]\n"
-		"-- Line Actions (lines 1-9) --\n"
-		"o     - Go off hook\n"
-		"dt    - Dial digits using DTMF\n"
-		"dp    - Dial digits using pulse dialing (not supported currently)\n"
-		"a     - Answer incoming call\n"
-		"f     - Hook flash\n"
-		"h     - Go on hook\n"
-		"p     - Play audio file\n"
-		"-- General Actions --\n"
-		"k     - hang up all active lines\n"
-		"s     - sleep for N seconds\n"
-		"ms    - sleep for N milliseconds\n"
-		"q     - Quit\n"
-		"-- Examples --\n"
-		"1o             ; originate on line 1\n"
-		"2 o            ; originate on line 2 (whitespace is ignored)\n"
-		"1dt47          ; dial DTMF 47 on line 1\n"
-		"3a             ; answer incoming call on line 3\n"
-		"1p custom/beep ; Play audio file on line\n"
-		"ms750          ; sleep for 750ms\n"
-	);
+	if (stats_any()) {
+		stats_dump();
+	}
+
+	if (got_sigint) {
+		fprintf(stderr, "\nAstMultiDialer exiting...\n");
+		return -1;
+	}
+	return 0;
 }
 
-static int multidialer(struct ami_session *ami)
+/*!
+ * \brief Load settings from a config file
+ * \note The format is like Asterisk config files: [sections] with key = value settings, and ; for comments
+ */
+static int load_config(const char *filename)
 {
-	struct pollfd pfd;
-	char *pos;
-	int left, reset, res;
-
-	tcgetattr(STDIN_FILENO, &origterm);
-	ttyterm = origterm;
+	FILE *fp;
+	char buf[256];
+	char section[64] = "general";
+	struct line_settings *settings = NULL;	/* Settings for the current [lines] section */
+	int lineno = 0, res = 0;
 
-	/* Set up the terminal */
-	ttyterm.c_lflag &= ~ICANON; /* Disable canonical mode to disable input buffering. Needed so poll works correctly on STDIN_FILENO */
-	signal(SIGINT, restore_term); /* Setup a signal handler for SIGINT, so we can restore the terminal. */
-	tcsetattr(STDIN_FILENO, TCSANOW, &ttyterm); /* Apply changes */
-
-	/* Wait for input. */
-	pfd.fd = STDIN_FILENO;
-	pfd.events = POLLIN;
+	fp = fopen(filename, "r");
+	if (!fp) {
+		fprintf(stderr, "Failed to open config file %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
 
-	reset = 1;
+	while (fgets(buf, sizeof(buf), fp)) {
+		char *key, *value, *tmp;
 
-	for (;;) {
-		if (reset) {
-			pos = inputbuf;
-			left = sizeof(inputbuf) - 1;
-			reset = 0;
-			fprintf(stderr, ">");
+		lineno++;
+		tmp = strchr(buf, ';');
+		if (tmp) {
+			*tmp = '\0';
 		}
-		/* This thread will block forever on input. */
-		res = poll(&pfd, 1, -1);
-		if (res < 0) {
-			if (errno == EINTR) {
-				continue;
+		key = trim(buf);
+		if (!*key) {
+			continue;
+		}
+		if (*key == '[') {
+			tmp = strchr(key, ']');
+			if (!tmp) {
+				fprintf(stderr, "%s:%d: Invalid section header\n", filename, lineno);
+				res = -1;
+				break;
 			}
-			break;
-		} else if (pfd.revents) {
-			/* Got some input. */
-			char c;
-			int num_read = read(STDIN_FILENO, &c, 1); /* Only read one char. */
-			if (num_read < 1) {
-				break; /* Disconnect */
+			*tmp = '\0';
+			snprintf(section, sizeof(section), "%s", key + 1);
+			settings = NULL;
+			if (!strcasecmp(section, "lines")) {
+				settings = &line_defaults;
+			} else if (!strncasecmp(section, "lines ", 6)) {
+				settings = line_settings_add(section + 6);
+				if (!settings) {
+					fprintf(stderr, "%s:%d: Invalid section header\n", filename, lineno);
+					res = -1;
+					break;
+				}
 			}
-			/*! \todo Might be nice to add command history (using histedit) */
-			if (c == '\n') {
-				/* Got a full command, execute */
-				*pos = '\0';
-				if (run_command(ami, inputbuf)) {
+			continue;
+		}
+		value = strchr(key, '=');
+		if (!value) {
+			fprintf(stderr, "%s:%d: Expected key = value\n", filename, lineno);
+			res = -1;
+			break;
+		}
+		*value++ = '\0';
+		key = trim(key);
+		value = trim(value);
+
+		if (!strcasecmp(section, "general")) {
+			if (!strcasecmp(key, "lines")) {
+				num_lines = atoi(value);
+			} else if (!strcasecmp(key, "window")) {
+				pipeline_window = atoi(value);
+			} else if (!strcasecmp(key, "connections")) {
+				connections_per_session = atoi(value);
+			} else if (!strcasecmp(key, "metrics")) {
+				snprintf(metrics_listen, sizeof(metrics_listen), "%s", value);
+			} else if (!strcasecmp(key, "calllog")) {
+				snprintf(calllog_file, sizeof(calllog_file), "%s", value);
+			} else if (!strcasecmp(key, "autoanswer")) {
+				auto_answer_ms = !strcasecmp(value, "no") ? -1 : atoi(value);
+			} else if (!strcasecmp(key, "pulserate")) {
+				pulse_pps = atoi(value);
+				if (pulse_pps < 1 || pulse_pps > 40) {
+					fprintf(stderr, "%s:%d: Pulse rate must be between 1 and 40 pulses per second\n", filename, lineno);
+					res = -1;
 					break;
 				}
-				inputbuf[0] = '\0';
-				reset = 1;
-			} else if (c == '?') {
-				show_command_help();
-				printf("\n");
-				reset = 1;
-			} else {
-				*pos++ = c;
-				if (--left <= 1) {
-					fprintf(stderr, "Command too long\n");
-					reset = 1;
+			} else if (!strcasecmp(key, "pulsebreak")) {
+				pulse_break_pct = atoi(value);
+				if (pulse_break_pct < 1 || pulse_break_pct > 99) {
+					fprintf(stderr, "%s:%d: Pulse break must be between 1 and 99 percent\n", filename, lineno);
+					res = -1;
+					break;
 				}
+			} else if (!strcasecmp(key, "pulsegap")) {
+				pulse_interdigit_ms = atoi(value);
+			} else if (!strcasecmp(key, "eventfilter")) {
+				event_filter = !strcasecmp(value, "yes") || !strcasecmp(value, "true") || atoi(value);
+			} else {
+				fprintf(stderr, "%s:%d: Unknown setting '%s'\n", filename, lineno, key);
+			}
+		} else if (settings) {
+			int setres = line_settings_set(settings, key, value);
+			if (setres < 0) {
+				fprintf(stderr, "%s:%d: Invalid setting '%s'\n", filename, lineno, key);
+				res = -1;
+				break;
+			} else if (setres) {
+				fprintf(stderr, "%s:%d: Unknown setting '%s'\n", filename, lineno, key);
 			}
+		} else {
+			fprintf(stderr, "%s:%d: Unknown section '%s'\n", filename, lineno, section);
 		}
 	}
 
-	ami_disconnect(ami);
-	ami_destroy(ami);
-	tcsetattr(STDIN_FILENO, TCSANOW, &origterm); /* Restore the original term settings */
-	return 0;
+	fclose(fp);
+	return res;
 }
 
 static void show_help(void)
 {
 	printf("AstMultiDialer for Asterisk\n");
+	printf(" -a           Originate asynchronously (don't wait for each line to go off hook)\n");
+	printf(" -A           Automatically answer inbound calls after they ring for this many ms (0 to answer immediately)\n");
+	printf(" -c           Config file\n");
 	printf(" -d           Enable AMI debug\n");
+	printf(" -D           Show a live dashboard of the state of each line\n");
+	printf(" -E           Don't ask Asterisk to filter events (receive all of them)\n");
+	printf(" -f           Script file to execute. The script is checked for errors before connecting.\n");
 	printf(" -h           Show this help\n");
-	printf(" -l           Asterisk AMI hostname. Default is localhost (127.0.0.1)\n");
+	printf(" -l           Asterisk AMI hostname, optionally with a port (host:port). Default is localhost (127.0.0.1)\n");
+	printf("              May be given more than once to use several servers, e.g. -l a=host1 -l b=host2:5039/1-10.\n");
+	printf("              Lines are divided evenly between servers, unless each is given a range of lines.\n");
+	printf(" -m           Serve metrics for Prometheus over HTTP on this port ([host:]port, localhost only by default)\n");
+	printf(" -n           Number of lines. Default is %d\n", DEFAULT_LINES);
+	printf(" -o           Log every action done on a line to this file, in a compact binary format (appended to if it exists)\n");
 	printf(" -p           Asterisk AMI password. By default, this will be autodetected for local connections if possible.\n");
+	printf(" -s           Number of AMI connections to each server. Lines are spread across them, so actions on different lines run in parallel. Default is 1\n");
 	printf(" -u           Asterisk AMI username.\n");
+	printf(" -w           Maximum number of actions (e.g. DTMF digits) in flight at once. Default is %d\n", DEFAULT_WINDOW);
+	printf(" -x           Convert a call log (from -o) to CSV on STDOUT, and exit\n");
+	printf(" -X           Convert a call log (from -o) to JSON (one object per line) on STDOUT, and exit\n");
 	printf("\n");
-	printf("You can use AstMultiDialer interactively, or you can feed it commands using a script file (just redirect the file to STDIN).\n");
+	printf("You can use AstMultiDialer interactively, or you can feed it commands using a script file (use -f, or just redirect the file to STDIN).\n");
 	printf("(C) 2023 Naveen Albert\n");
 }
 
@@ -412,39 +5529,139 @@ static void show_help(void)
 int main(int argc,char *argv[])
 {
 	char c;
-	static const char *getopt_settings = "?dhl:p:u:";
-	char ami_host[92] = "127.0.0.1"; /* Default to localhost */
-	char ami_username[64] = "";
-	char ami_password[64] = "";
-	static int ami_debug_level = 0;
-	struct ami_session *ami;
+	static const char *getopt_settings = "?aA:c:dDEf:hl:m:n:o:p:s:u:w:x:X:";
+	const char *config_file = NULL, *script_file = NULL, *cli_calllog = NULL, *cli_metrics = NULL;
+	int cli_lines = 0, cli_window = 0, cli_connections = 0, cli_auto_answer = -1, i;
+	struct script *script = NULL;
 
 	while ((c = getopt(argc, argv, getopt_settings)) != -1) {
 		switch (c) {
+		case 'a':
+			async_originate = 1;
+			break;
+		case 'A':
+			cli_auto_answer = atoi(optarg);
+			break;
+		case 'c':
+			config_file = optarg;
+			break;
 		case 'd':
 			ami_debug_level++;
 			break;
+		case 'D':
+			dashboard = 1;
+			break;
+		case 'E':
+			event_filter = 0;
+			break;
+		case 'f':
+			script_file = optarg;
+			break;
 		case '?':
 		case 'h':
 			show_help();
 			return 0;
 		case 'l':
-			strncpy(ami_host, optarg, sizeof(ami_host));
+			if (session_add(optarg)) {
+				return -1;
+			}
+			break;
+		case 'm':
+			cli_metrics = optarg;
+			break;
+		case 'n':
+			cli_lines = atoi(optarg);
+			break;
+		case 'o':
+			cli_calllog = optarg;
 			break;
 		case 'p':
-			strncpy(ami_password, optarg, sizeof(ami_password));
+			snprintf(ami_password, sizeof(ami_password), "%s", optarg);
+			break;
+		case 's':
+			cli_connections = atoi(optarg);
 			break;
 		case 'u':
-			strncpy(ami_username, optarg, sizeof(ami_username));
+			snprintf(ami_username, sizeof(ami_username), "%s", optarg);
 			break;
+		case 'w':
+			cli_window = atoi(optarg);
+			break;
+		case 'x':
+			return calllog_convert(optarg, 0);
+		case 'X':
+			return calllog_convert(optarg, 1);
 		default:
 			fprintf(stderr, "Invalid option: %c\n", c);
 			return -1;
 		}
 	}
 
-	if (ami_username[0] && !ami_password[0] && !strcmp(ami_host, "127.0.0.1")) {
-		/* If we're running as a privileged user with access to manager.conf, grab the password ourselves, which is more
+	/* Settings on the command line take precedence over the config file */
+	if (config_file && load_config(config_file)) {
+		return -1;
+	}
+	if (cli_lines) {
+		num_lines = cli_lines;
+	}
+	if (cli_window) {
+		pipeline_window = cli_window;
+	}
+	if (cli_connections) {
+		connections_per_session = cli_connections;
+	}
+	if (cli_auto_answer >= 0) {
+		auto_answer_ms = cli_auto_answer;
+	}
+	if (cli_calllog) {
+		snprintf(calllog_file, sizeof(calllog_file), "%s", cli_calllog);
+	}
+	if (cli_metrics) {
+		snprintf(metrics_listen, sizeof(metrics_listen), "%s", cli_metrics);
+	}
+	if (connections_per_session < 1 || connections_per_session > MAX_CONNECTIONS) {
+		fprintf(stderr, "Number of connections must be between 1 and %d\n", MAX_CONNECTIONS);
+		return -1;
+	}
+	if (pipeline_window < 1) {
+		fprintf(stderr, "Window must be at least 1\n");
+		return -1;
+	}
+	if (num_lines < 1 || num_lines > MAX_LINES) {
+		fprintf(stderr, "Number of lines must be between 1 and %d\n", MAX_LINES);
+		return -1;
+	}
+	lines = calloc(num_lines + 1, sizeof(*lines));
+	if (!lines) {
+		fprintf(stderr, "Failed to allocate %d lines\n", num_lines);
+		return -1;
+	}
+
+	/* Parse the whole script before connecting, so we don't leave calls up if it turns out to have a mistake */
+	if (script_file) {
+		script = script_compile(script_file);
+		if (!script) {
+			return -1;
+		}
+	}
+
+	if (!num_sessions && session_add("127.0.0.1")) { /* Default to localhost */
+		return -1;
+	}
+	if (sessions_assign_lines() || line_index_build()) {
+		return -1;
+	}
+
+	for (i = 0; ami_username[0] && !ami_password[0] && i < num_sessions; i++) {
+		if (!host_is_loopback(sessions[i].host)) {
+			/* Our manager.conf says nothing about another machine's */
+			fprintf(stderr, "No password specified for %s (use -p); it can only be autodetected for a server on this machine\n", sessions[i].name);
+			return -1;
+		}
+	}
+	if (ami_username[0] && !ami_password[0]) {
+		/* Every server is on this machine, so the password from our manager.conf applies to all of them.
+		 * If we're running as a privileged user with access to manager.conf, grab the password ourselves, which is more
 		 * secure than getting as a command line arg from the user (and kind of convenient)
 		 * Not that running as a user with access to the Asterisk config is great either, but, hey...
 		 */
@@ -459,14 +5676,18 @@ int main(int argc,char *argv[])
 		return -1;
 	}
 
-	global_ami = ami = ami_connect(ami_host, 0, ami_callback, simple_disconnect_callback);
-	if (!ami) {
-		fprintf(stderr, "Failed to connect to AMI (host: %s, user: %s)\n", ami_host, ami_username);
+	/* Before connecting, since calls can start ringing as soon as we're receiving events */
+	line_wait_init();
+	pulse_init();
+	if (calllog_start() || auto_answer_start()) {
 		return -1;
 	}
-	if (ami_action_login(ami, ami_username, ami_password)) {
-		fprintf(stderr, "Failed to log in with username %s\n", ami_username);
-		return -1;
+
+	events_since = monotonic_ns();
+	for (i = 0; i < num_sessions; i++) {
+		if (session_connect(&sessions[i])) {
+			return -1;
+		}
 	}
 
 	/* Clear the screen. */
@@ -476,12 +5697,25 @@ int main(int argc,char *argv[])
 	fflush(stdout);
 
 	if (ami_debug_level) {
-		ami_set_debug(ami, STDERR_FILENO);
-		ami_set_debug_level(ami, ami_debug_level);
 		fprintf(stderr, "AMI debug level is %d\n", ami_debug_level);
 	}
+	if (num_sessions > 1) {
+		for (i = 0; i < num_sessions; i++) {
+			fprintf(stderr, "Lines %d-%d are on %s (%s)\n", sessions[i].first_line, sessions[i].last_line, sessions[i].name, sessions[i].host);
+		}
+	}
+
+	if (pipeline_start() || reconnect_start()) {
+		return -1;
+	}
+	if (dashboard && dashboard_start()) {
+		return -1;
+	}
+	if (metrics_start()) {
+		return -1;
+	}
 
-	if (multidialer(ami)) {
+	if (multidialer(script)) {
 		return -1;
 	}
 	return 0;
@@ -0,0 +1,98 @@
+#!/bin/sh
+
+# Benchmark AstMultiDialer against the mock AMI server
+#
+# Settings can be overridden using environment variables:
+# BENCH_LINES    - number of lines to use
+# BENCH_LATENCY  - latency added to each action by the mock server, in ms
+# BENCH_EVENTS   - unrelated events per second generated by the mock server
+# BENCH_WINDOW   - dialer pipeline window (-w)
+# BENCH_CONNECTIONS - number of AMI connections used by the dialer (-s)
+# BENCH_NOFILTER - set to 1 to receive all events, rather than having the server filter them (-E)
+# BENCH_PORT     - port for the mock server
+# BENCH_DIALER   - dialer executable to benchmark (make bench uses the release build)
+# BENCH_MOCK     - mock server executable
+
+LINES=${BENCH_LINES:-200}
+LATENCY=${BENCH_LATENCY:-1}
+EVENTS=${BENCH_EVENTS:-0}
+WINDOW=${BENCH_WINDOW:-8}
+CONNECTIONS=${BENCH_CONNECTIONS:-1}
+PORT=${BENCH_PORT:-15038}
+DIALER=${BENCH_DIALER:-./astmultidialer}
+MOCK=${BENCH_MOCK:-./mockami}
+FILTER_OPT=
+if [ "${BENCH_NOFILTER:-0}" != "0" ]; then
+	FILTER_OPT=-E
+fi
+
+SCRIPT=$(mktemp)
+MOCK_LOG=$(mktemp)
+TIMES=$(mktemp)
+
+$MOCK -p $PORT -l $LATENCY -e $EVENTS 2> $MOCK_LOG &
+MOCK_PID=$!
+trap 'kill $MOCK_PID 2>/dev/null; rm -f $SCRIPT $MOCK_LOG $TIMES' EXIT
+sleep 1
+if ! kill -0 $MOCK_PID 2>/dev/null; then
+	cat $MOCK_LOG
+	exit 1
+fi
+
+# The workload: take all lines off hook, dial and flash on all of them at once,
+# then do the same thing one line at a time, and hang up.
+{
+	echo "1-$LINES o"
+	echo "*dt123456789"
+	echo "*f"
+	i=1
+	while [ $i -le $LINES ]; do
+		echo "${i}f"
+		echo "${i}dt0"
+		i=$((i + 1))
+	done
+	echo "*h"
+	echo "q"
+} > $SCRIPT
+
+COMMANDS=$(wc -l < $SCRIPT)
+START=$(date +%s%N)
+# Run the dialer in a subshell, so that the CPU time used by its children (i.e. just the dialer) can be reported by times
+(
+	$DIALER -l 127.0.0.1:$PORT -u bench -p bench -n $LINES -w $WINDOW -s $CONNECTIONS $FILTER_OPT < $SCRIPT > /dev/null 2> bench_output.txt
+	RES=$?
+	times > $TIMES
+	exit $RES
+)
+RES=$?
+END=$(date +%s%N)
+
+kill $MOCK_PID
+wait $MOCK_PID 2>/dev/null
+
+if [ $RES -ne 0 ]; then
+	echo "Dialer exited with status $RES, see bench_output.txt"
+	exit 1
+fi
+
+ACTIONS=$(sed -n 's/.*handled \([0-9]*\) actions.*/\1/p' $MOCK_LOG)
+# The second line of times is the user and system time of children, e.g. 0m0.120s 0m0.040s
+CPU_MS=$(sed -n '2p' $TIMES | awk '{
+	ms = 0
+	for (i = 1; i <= 2; i++) {
+		split($i, t, "m")
+		ms += (t[1] * 60 + t[2]) * 1000
+	}
+	printf "%d", ms
+}')
+SENT=$(sed -n 's/.*sent \([0-9]*\) events (\([0-9]*\) KB).*/\1 events (\2 KB)/p' $MOCK_LOG)
+awk -v ns=$((END - START)) -v commands=$COMMANDS -v actions=${ACTIONS:-0} -v lines=$LINES -v latency=$LATENCY -v window=$WINDOW -v connections=$CONNECTIONS -v cpu=${CPU_MS:-0} 'BEGIN {
+	secs = ns / 1000000000
+	printf "%d lines, %d ms action latency, window %d, %d connection%s\n", lines, latency, window, connections, connections == 1 ? "" : "s"
+	printf "%d commands, %d AMI actions in %.3f s\n", commands, actions, secs
+	printf "Throughput: %.1f commands/s, %.1f actions/s\n", commands / secs, actions / secs
+	printf "Dialer CPU time: %d ms (%.0f%% of one core), %.1f us per call, %.1f us per AMI action\n", cpu, cpu / 10 / secs, cpu * 1000 / lines, actions ? cpu * 1000 / actions : 0
+}'
+echo "Server sent ${SENT:-0 events}"
+echo
+tr '\r' '\n' < bench_output.txt | sed -n 's/^>*//; /^AMI action latency/,$p'
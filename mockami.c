@@ -0,0 +1,699 @@
+/*
+ * AstMultiDialer: CLI dialer for Asterisk
+ *
+ * Copyright (C) 2023, Naveen Albert
+ *
+ * Naveen Albert <asterisk@phreaknet.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*! \file
+ *
+ * \brief Mock Asterisk Manager Interface server, for benchmarking AstMultiDialer
+ *
+ * \author Naveen Albert <asterisk@phreaknet.org>
+ */
+
+/*
+ * This speaks just enough of AMI to exercise AstMultiDialer without a real Asterisk:
+ * Login, Logoff, Originate (sync and async), Hangup, SendFlash, PlayDTMF,
+ * CoreShowChannels, Setvar, Redirect, Filter and Events.
+ * It can also generate inbound calls, which ring until they're answered by redirecting them.
+ *
+ * Like Asterisk, actions on a connection are processed one at a time, in order.
+ * Each action can be delayed to simulate a slow PBX, and unrelated "noise" events
+ * can be generated to simulate a busy one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <regex.h>
+
+#define MAX_HEADERS 32
+#define MAX_FILTERS 16
+
+/* Event classes, as used by the Events action */
+#define EVENT_CALL (1 << 0)
+#define EVENT_DTMF (1 << 1)
+#define EVENT_DIALPLAN (1 << 2)
+#define EVENT_SYSTEM (1 << 3)
+#define EVENT_ALL (~0u)
+
+struct client {
+	struct client *next;
+	int fd;
+	int loggedin;
+	unsigned int eventmask;
+	int nfilters;
+	regex_t filters[MAX_FILTERS]; /* Only send events matching one of these, if any */
+	pthread_mutex_t lock; /* Serializes writes */
+};
+
+struct channel {
+	struct channel *next;
+	char name[128];
+};
+
+struct action {
+	int count;
+	char *keys[MAX_HEADERS];
+	char *values[MAX_HEADERS];
+};
+
+static struct client *clients = NULL;
+static struct channel *channels = NULL;
+static pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t channels_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int latency_ms = 0;
+static int noise_rate = 0;
+static int inbound_rate = 0;
+static int inbound_lines = 9;
+static int verbose = 0;
+static unsigned int channel_seq = 0;
+
+static unsigned long actions_handled = 0;
+static unsigned long events_sent = 0;
+static unsigned long event_bytes_sent = 0;
+static volatile sig_atomic_t shutting_down = 0;
+static int shutdown_pipe[2] = { -1, -1 };
+
+static int client_send(struct client *c, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+
+static int client_send(struct client *c, const char *fmt, ...)
+{
+	char buf[4096];
+	va_list ap;
+	int len, res = 0;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (len >= (int) sizeof(buf)) {
+		len = sizeof(buf) - 1;
+	}
+
+	pthread_mutex_lock(&c->lock);
+	if (write(c->fd, buf, len) != len) {
+		res = -1;
+	}
+	pthread_mutex_unlock(&c->lock);
+	return res;
+}
+
+/*! \brief Whether a client wants an event, according to its event mask and filters */
+static int client_wants_event(struct client *c, unsigned int category, const char *event)
+{
+	int i;
+
+	if (!c->loggedin || !(c->eventmask & category)) {
+		return 0;
+	}
+	if (!c->nfilters) {
+		return 1;
+	}
+	for (i = 0; i < c->nfilters; i++) {
+		if (!regexec(&c->filters[i], event, 0, NULL, 0)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void broadcast_event(unsigned int category, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+
+/*! \brief Send an event to all logged in clients that want it */
+static void broadcast_event(unsigned int category, const char *fmt, ...)
+{
+	char buf[2048];
+	struct client *c;
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	pthread_mutex_lock(&clients_lock);
+	for (c = clients; c; c = c->next) {
+		if (client_wants_event(c, category, buf)) {
+			client_send(c, "%s\r\n", buf);
+			__atomic_fetch_add(&events_sent, 1, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&event_bytes_sent, (unsigned long) len + 2, __ATOMIC_RELAXED);
+		}
+	}
+	pthread_mutex_unlock(&clients_lock);
+}
+
+/*! \brief Parse an event mask, e.g. on, off, or call,dtmf */
+static unsigned int parse_eventmask(const char *mask)
+{
+	char buf[256];
+	char *cur, *next;
+	unsigned int res = 0;
+
+	if (!strcasecmp(mask, "on") || !strcasecmp(mask, "all")) {
+		return EVENT_ALL;
+	} else if (!strcasecmp(mask, "off")) {
+		return 0;
+	}
+	snprintf(buf, sizeof(buf), "%s", mask);
+	for (next = buf; (cur = strsep(&next, ","));) {
+		if (!strcasecmp(cur, "call")) {
+			res |= EVENT_CALL;
+		} else if (!strcasecmp(cur, "dtmf")) {
+			res |= EVENT_DTMF;
+		} else if (!strcasecmp(cur, "dialplan")) {
+			res |= EVENT_DIALPLAN;
+		} else if (!strcasecmp(cur, "system")) {
+			res |= EVENT_SYSTEM;
+		}
+	}
+	return res;
+}
+
+static const char *action_header(struct action *action, const char *key)
+{
+	int i;
+
+	for (i = 0; i < action->count; i++) {
+		if (!strcasecmp(action->keys[i], key)) {
+			return action->values[i];
+		}
+	}
+	return "";
+}
+
+static int channel_add(const char *name)
+{
+	struct channel *chan = calloc(1, sizeof(*chan));
+
+	if (!chan) {
+		return -1;
+	}
+	snprintf(chan->name, sizeof(chan->name), "%s", name);
+	pthread_mutex_lock(&channels_lock);
+	chan->next = channels;
+	channels = chan;
+	pthread_mutex_unlock(&channels_lock);
+	return 0;
+}
+
+/*! \brief Whether a device has any channels */
+static int device_busy(const char *device)
+{
+	struct channel *chan;
+	size_t len = strlen(device);
+	int busy = 0;
+
+	pthread_mutex_lock(&channels_lock);
+	for (chan = channels; chan; chan = chan->next) {
+		if (!strncmp(chan->name, device, len) && chan->name[len] == '-') {
+			busy = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&channels_lock);
+	return busy;
+}
+
+/*! \brief Create a channel for a dial string, e.g. PJSIP/01@autotest1 becomes PJSIP/autotest1-00000001 */
+static void channel_new(const char *dialstr, char *buf, size_t len)
+{
+	const char *tech_end = strchr(dialstr, '/');
+	const char *resource = strchr(dialstr, '@');
+	unsigned int seq = __atomic_add_fetch(&channel_seq, 1, __ATOMIC_RELAXED);
+
+	if (!resource) {
+		resource = tech_end ? tech_end : dialstr - 1;
+	}
+	snprintf(buf, len, "%.*s/%s-%08x", tech_end ? (int) (tech_end - dialstr) : 5, tech_end ? dialstr : "Local", resource + 1, seq);
+
+	if (channel_add(buf)) {
+		return;
+	}
+	broadcast_event(EVENT_CALL, "Event: Newchannel\r\nChannel: %s\r\nChannelState: 0\r\nChannelStateDesc: Down\r\nUniqueid: %u\r\n", buf, seq);
+	broadcast_event(EVENT_CALL, "Event: Newstate\r\nChannel: %s\r\nChannelState: 5\r\nChannelStateDesc: Ringing\r\nUniqueid: %u\r\n", buf, seq);
+	broadcast_event(EVENT_CALL, "Event: Newstate\r\nChannel: %s\r\nChannelState: 6\r\nChannelStateDesc: Up\r\nUniqueid: %u\r\n", buf, seq);
+}
+
+/*! \brief Whether a channel exists. If remove is set, also hang it up. */
+static int channel_exists(const char *name, int remove)
+{
+	struct channel *chan, **prev;
+	int found = 0;
+
+	pthread_mutex_lock(&channels_lock);
+	for (prev = &channels; (chan = *prev); prev = &chan->next) {
+		if (!strcmp(chan->name, name)) {
+			found = 1;
+			if (remove) {
+				*prev = chan->next;
+				free(chan);
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&channels_lock);
+
+	if (found && remove) {
+		broadcast_event(EVENT_CALL, "Event: Hangup\r\nChannel: %s\r\nCause: 16\r\nCause-txt: Normal Clearing\r\n", name);
+	}
+	return found;
+}
+
+static void simulate_latency(void)
+{
+	if (latency_ms) {
+		usleep(latency_ms * 1000);
+	}
+}
+
+struct async_originate {
+	char dialstr[128];
+	char actionid[64];
+};
+
+static void *async_originate_thread(void *varg)
+{
+	struct async_originate *ao = varg;
+	char channel[128];
+
+	simulate_latency();
+	channel_new(ao->dialstr, channel, sizeof(channel));
+	broadcast_event(EVENT_CALL, "Event: OriginateResponse\r\nActionID: %s\r\nResponse: Success\r\nChannel: %s\r\nReason: 4\r\n", ao->actionid, channel);
+	free(ao);
+	return NULL;
+}
+
+#define RESPOND_SUCCESS(c, actionid, msg) client_send(c, "Response: Success\r\nActionID: %s\r\nMessage: %s\r\n\r\n", actionid, msg)
+#define RESPOND_ERROR(c, actionid, msg) client_send(c, "Response: Error\r\nActionID: %s\r\nMessage: %s\r\n\r\n", actionid, msg)
+
+static void handle_action(struct client *c, struct action *action)
+{
+	const char *name = action_header(action, "Action");
+	const char *actionid = action_header(action, "ActionID");
+	const char *channel = action_header(action, "Channel");
+
+	__atomic_fetch_add(&actions_handled, 1, __ATOMIC_RELAXED);
+	if (verbose) {
+		fprintf(stderr, "Action: %s (%s)\n", name, channel);
+	}
+
+	if (!strcasecmp(name, "Login")) {
+		c->loggedin = 1;
+		RESPOND_SUCCESS(c, actionid, "Authentication accepted");
+		return;
+	} else if (!c->loggedin) {
+		RESPOND_ERROR(c, actionid, "Permission denied");
+		return;
+	}
+
+	simulate_latency();
+
+	if (!strcasecmp(name, "Logoff")) {
+		client_send(c, "Response: Goodbye\r\nActionID: %s\r\nMessage: Thanks for all the fish.\r\n\r\n", actionid);
+	} else if (!strcasecmp(name, "Originate")) {
+		if (!strcasecmp(action_header(action, "Async"), "true")) {
+			pthread_t thread;
+			struct async_originate *ao = calloc(1, sizeof(*ao));
+			if (!ao) {
+				RESPOND_ERROR(c, actionid, "Originate failed");
+				return;
+			}
+			snprintf(ao->dialstr, sizeof(ao->dialstr), "%s", channel);
+			snprintf(ao->actionid, sizeof(ao->actionid), "%s", actionid);
+			RESPOND_SUCCESS(c, actionid, "Originate successfully queued");
+			if (pthread_create(&thread, NULL, async_originate_thread, ao)) {
+				free(ao);
+			} else {
+				pthread_detach(thread);
+			}
+		} else {
+			char newchan[128];
+			channel_new(channel, newchan, sizeof(newchan));
+			RESPOND_SUCCESS(c, actionid, "Originate successfully queued");
+		}
+	} else if (!strcasecmp(name, "Hangup")) {
+		if (channel_exists(channel, 1)) {
+			RESPOND_SUCCESS(c, actionid, "Channel Hungup");
+		} else {
+			RESPOND_ERROR(c, actionid, "No such channel");
+		}
+	} else if (!strcasecmp(name, "SendFlash") || !strcasecmp(name, "PlayDTMF") || !strcasecmp(name, "Setvar") || !strcasecmp(name, "Redirect")) {
+		if (channel_exists(channel, 0)) {
+			if (!strcasecmp(name, "PlayDTMF")) {
+				broadcast_event(EVENT_DTMF, "Event: DTMFEnd\r\nChannel: %s\r\nDigit: %s\r\nDirection: Sent\r\n", channel, action_header(action, "Digit"));
+			} else if (!strcasecmp(name, "Redirect")) {
+				/* The dialplan it's sent to answers it */
+				broadcast_event(EVENT_CALL, "Event: Newstate\r\nChannel: %s\r\nChannelState: 6\r\nChannelStateDesc: Up\r\n", channel);
+			}
+			RESPOND_SUCCESS(c, actionid, "OK");
+		} else {
+			RESPOND_ERROR(c, actionid, "No such channel");
+		}
+	} else if (!strcasecmp(name, "CoreShowChannels")) {
+		struct channel *chan;
+		int count = 0;
+		client_send(c, "Response: Success\r\nActionID: %s\r\nEventList: start\r\nMessage: Channels will follow\r\n\r\n", actionid);
+		pthread_mutex_lock(&channels_lock);
+		for (chan = channels; chan; chan = chan->next) {
+			client_send(c, "Event: CoreShowChannel\r\nActionID: %s\r\nChannel: %s\r\nChannelState: 6\r\nChannelStateDesc: Up\r\n\r\n", actionid, chan->name);
+			count++;
+		}
+		pthread_mutex_unlock(&channels_lock);
+		client_send(c, "Event: CoreShowChannelsComplete\r\nActionID: %s\r\nEventList: Complete\r\nListItems: %d\r\n\r\n", actionid, count);
+	} else if (!strcasecmp(name, "Events")) {
+		c->eventmask = parse_eventmask(action_header(action, "EventMask"));
+		RESPOND_SUCCESS(c, actionid, "OK");
+	} else if (!strcasecmp(name, "Filter")) {
+		const char *filter = action_header(action, "Filter");
+		int res = -1;
+		/* broadcast_event() reads the filters while holding clients_lock */
+		if (!strcasecmp(action_header(action, "Operation"), "Add") && *filter && filter[0] != '!' && c->nfilters < MAX_FILTERS) {
+			pthread_mutex_lock(&clients_lock);
+			res = regcomp(&c->filters[c->nfilters], filter, REG_EXTENDED | REG_NOSUB | REG_NEWLINE);
+			if (!res) {
+				c->nfilters++;
+			}
+			pthread_mutex_unlock(&clients_lock);
+		}
+		if (res) {
+			RESPOND_ERROR(c, actionid, "Filter not supported");
+		} else {
+			RESPOND_SUCCESS(c, actionid, "Filter Added Successfully");
+		}
+	} else {
+		RESPOND_ERROR(c, actionid, "Invalid/unknown command");
+	}
+}
+
+/*! \brief Parse an action in place. Returns 0 on success, -1 if it's not an action. */
+static int parse_action(char *msg, struct action *action)
+{
+	char *line;
+
+	action->count = 0;
+	while ((line = strsep(&msg, "\r\n"))) {
+		char *value;
+		if (!*line) {
+			continue;
+		}
+		value = strchr(line, ':');
+		if (!value || action->count == MAX_HEADERS) {
+			continue;
+		}
+		*value++ = '\0';
+		while (isspace(*value)) {
+			value++;
+		}
+		action->keys[action->count] = line;
+		action->values[action->count] = value;
+		action->count++;
+	}
+	return action->count ? 0 : -1;
+}
+
+static void *client_thread(void *varg)
+{
+	struct client *c = varg, **prev;
+	char buf[65536];
+	size_t len = 0;
+
+	client_send(c, "Asterisk Call Manager/5.0.1\r\n");
+
+	for (;;) {
+		char *end;
+		ssize_t res = read(c->fd, buf + len, sizeof(buf) - len - 1);
+		if (res <= 0) {
+			break;
+		}
+		len += res;
+		buf[len] = '\0';
+		/* Process every complete action in the buffer */
+		while ((end = strstr(buf, "\r\n\r\n"))) {
+			struct action action;
+			size_t used = end + 4 - buf;
+			*end = '\0';
+			if (!parse_action(buf, &action)) {
+				handle_action(c, &action);
+			}
+			memmove(buf, buf + used, len - used + 1);
+			len -= used;
+		}
+		if (len == sizeof(buf) - 1) {
+			fprintf(stderr, "Action too large, disconnecting client\n");
+			break;
+		}
+	}
+
+	pthread_mutex_lock(&clients_lock);
+	for (prev = &clients; *prev; prev = &(*prev)->next) {
+		if (*prev == c) {
+			*prev = c->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&clients_lock);
+
+	close(c->fd);
+	while (c->nfilters) {
+		regfree(&c->filters[--c->nfilters]);
+	}
+	pthread_mutex_destroy(&c->lock);
+	free(c);
+	return NULL;
+}
+
+/*! \brief Generate events for channels that aren't ours, like a busy PBX would */
+static void *noise_thread(void *varg)
+{
+	unsigned int seq = 0;
+	long interval_us = 1000000L / noise_rate;
+
+	(void) varg;
+	while (!shutting_down) {
+		seq++;
+		/* Half of it is dialplan chatter, the other half calls that aren't ours */
+		if (seq % 2) {
+			broadcast_event(EVENT_DIALPLAN, "Event: VarSet\r\nChannel: PJSIP/noise-%08x\r\nVariable: NOISE\r\nValue: %u\r\nUniqueid: noise.%u\r\n", seq, seq, seq);
+		} else {
+			broadcast_event(EVENT_CALL, "Event: Newstate\r\nChannel: PJSIP/noise-%08x\r\nChannelState: 5\r\nChannelStateDesc: Ringing\r\nUniqueid: noise.%u\r\n", seq, seq);
+		}
+		usleep(interval_us);
+	}
+	return NULL;
+}
+
+/*! \brief Whether anyone would see an inbound call (otherwise it would just ring forever without anybody knowing) */
+static int any_client_loggedin(void)
+{
+	struct client *c;
+	int found = 0;
+
+	pthread_mutex_lock(&clients_lock);
+	for (c = clients; c; c = c->next) {
+		if (c->loggedin) {
+			found = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&clients_lock);
+	return found;
+}
+
+/*! \brief Generate inbound calls to idle lines, which ring until they're answered (or hung up) */
+static void *inbound_thread(void *varg)
+{
+	long interval_us = 1000000L / inbound_rate;
+
+	(void) varg;
+	while (!shutting_down) {
+		char device[64], name[128];
+		unsigned int seq = __atomic_add_fetch(&channel_seq, 1, __ATOMIC_RELAXED);
+		snprintf(device, sizeof(device), "PJSIP/autotest%d", rand() % inbound_lines + 1);
+		if (any_client_loggedin() && !device_busy(device)) {
+			snprintf(name, sizeof(name), "%s-%08x", device, seq);
+			if (!channel_add(name)) {
+				broadcast_event(EVENT_CALL, "Event: Newchannel\r\nChannel: %s\r\nChannelState: 4\r\nChannelStateDesc: Ring\r\nUniqueid: %u\r\n", name, seq);
+			}
+		}
+		usleep(interval_us);
+	}
+	return NULL;
+}
+
+static void shutdown_handler(int num)
+{
+	shutting_down = 1;
+	if (write(shutdown_pipe[1], "", 1) < 0) {
+		/* Nothing we can do */
+	}
+}
+
+static void show_help(void)
+{
+	printf("Mock AMI server for AstMultiDialer\n");
+	printf(" -e           Number of unrelated events to generate per second. Default is 0\n");
+	printf(" -h           Show this help\n");
+	printf(" -i           Number of inbound calls to generate per second, to random idle lines. Default is 0\n");
+	printf(" -l           Latency to add to each action, in ms. Default is 0\n");
+	printf(" -n           Number of lines to send inbound calls to. Default is 9\n");
+	printf(" -p           Port to listen on. Default is 5038\n");
+	printf(" -v           Log each action\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+	int port = 5038;
+	int sfd, on = 1;
+	struct sockaddr_in sin;
+	struct pollfd pfds[2];
+	pthread_t thread;
+
+	while ((c = getopt(argc, argv, "?e:hi:l:n:p:v")) != -1) {
+		switch (c) {
+		case 'e':
+			noise_rate = atoi(optarg);
+			break;
+		case '?':
+		case 'h':
+			show_help();
+			return 0;
+		case 'i':
+			inbound_rate = atoi(optarg);
+			break;
+		case 'l':
+			latency_ms = atoi(optarg);
+			break;
+		case 'n':
+			inbound_lines = atoi(optarg);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			fprintf(stderr, "Invalid option: %c\n", c);
+			return -1;
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	if (pipe(shutdown_pipe)) {
+		fprintf(stderr, "pipe failed: %s\n", strerror(errno));
+		return -1;
+	}
+	signal(SIGINT, shutdown_handler);
+	signal(SIGTERM, shutdown_handler);
+
+	sfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (sfd < 0) {
+		fprintf(stderr, "socket failed: %s\n", strerror(errno));
+		return -1;
+	}
+	setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = htons(port);
+	if (bind(sfd, (struct sockaddr *) &sin, sizeof(sin)) || listen(sfd, 16)) {
+		fprintf(stderr, "Failed to listen on port %d: %s\n", port, strerror(errno));
+		close(sfd);
+		return -1;
+	}
+	fprintf(stderr, "Mock AMI server listening on port %d (latency %d ms, %d noise events/s)\n", port, latency_ms, noise_rate);
+
+	if (noise_rate > 0) {
+		if (pthread_create(&thread, NULL, noise_thread, NULL)) {
+			fprintf(stderr, "Failed to create noise thread\n");
+			return -1;
+		}
+		pthread_detach(thread);
+	}
+	if (inbound_rate > 0 && inbound_lines > 0) {
+		if (pthread_create(&thread, NULL, inbound_thread, NULL)) {
+			fprintf(stderr, "Failed to create inbound call thread\n");
+			return -1;
+		}
+		pthread_detach(thread);
+	}
+
+	pfds[0].fd = sfd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = shutdown_pipe[0];
+	pfds[1].events = POLLIN;
+	while (!shutting_down) {
+		struct client *client;
+		int fd;
+
+		if (poll(pfds, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		if (pfds[1].revents) {
+			break;
+		}
+		fd = accept(sfd, NULL, NULL);
+		if (fd < 0) {
+			continue;
+		}
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		client = calloc(1, sizeof(*client));
+		if (!client) {
+			close(fd);
+			continue;
+		}
+		client->fd = fd;
+		client->eventmask = EVENT_ALL;
+		pthread_mutex_init(&client->lock, NULL);
+		pthread_mutex_lock(&clients_lock);
+		client->next = clients;
+		clients = client;
+		pthread_mutex_unlock(&clients_lock);
+		if (pthread_create(&thread, NULL, client_thread, client)) {
+			fprintf(stderr, "Failed to create client thread\n");
+			pthread_mutex_lock(&clients_lock);
+			clients = client->next;
+			pthread_mutex_unlock(&clients_lock);
+			close(fd);
+			pthread_mutex_destroy(&client->lock);
+			free(client);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+
+	close(sfd);
+	fprintf(stderr, "Mock AMI server handled %lu actions, sent %lu events (%lu KB)\n", actions_handled, events_sent, event_bytes_sent / 1024);
+	return 0;
+}